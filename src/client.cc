@@ -0,0 +1,68 @@
+#include <iostream>
+#include <string>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <boost/program_options.hpp>
+
+using namespace std;
+namespace po = boost::program_options;
+
+// Sends each line of stdin to a running bin/server as a sentence to score,
+// and prints the server's answers, one per line, in the same order
+int main(int argc, char** argv) {
+  po::options_description desc("description");
+  desc.add_options()
+  ("help", "Display this help message")
+  ("socket", po::value<string>()->required(), "The server's Unix domain socket")
+  ("tokens", "Also print the log probability of each word");
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+
+  if (vm.count("help")) {
+    cerr << desc;
+    return 1;
+  }
+
+  po::notify(vm);
+
+  const string path = vm["socket"].as<string>();
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    cerr << "Socket path " << path << " is too long." << endl;
+    return 1;
+  }
+  strcpy(address.sun_path, path.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+    cerr << "Unable to connect to " << path << ": " << strerror(errno) << endl;
+    return 1;
+  }
+  FILE* in = fdopen(fd, "r");
+  FILE* out = fdopen(dup(fd), "w");
+
+  const string command = vm.count("tokens") ? "TOKENS " : "SCORE ";
+  char* buffer = nullptr;
+  size_t capacity = 0;
+  for (string line; getline(cin, line);) {
+    fprintf(out, "%s%s\n", command.c_str(), line.c_str());
+    fflush(out);
+    if (getline(&buffer, &capacity, in) == -1) {
+      cerr << "The server closed the connection." << endl;
+      return 1;
+    }
+    cout << buffer << flush;
+  }
+
+  free(buffer);
+  fclose(out);
+  fclose(in);
+  return 0;
+}
@@ -1,4 +1,10 @@
 #include <boost/algorithm/string/predicate.hpp>
+#include <boost/serialization/vector.hpp>
+#include <fstream>
+#include <unordered_set>
+#include <algorithm>
+#include <limits>
+#include <set>
 #include "deplm.h"
 
 const unsigned lstm_layer_count = 2;
@@ -33,9 +39,13 @@ Expression OutputModel::Loss(const shared_ptr<const Word> ref) {
   return Loss(GetStatePointer(), ref);
 }
 
-DependencyOutputModel::DependencyOutputModel() {}
+vector<RNNPointer> OutputModel::Compact(const vector<RNNPointer>& live) {
+  return live;
+}
+
+DependencyOutputModel::DependencyOutputModel() : class_softmax(nullptr), loss_sampler(nullptr), loss_sample_count(0), shortlist(nullptr) {}
 
-DependencyOutputModel::DependencyOutputModel(Model& model, Embedder* embedder, unsigned state_dim, unsigned final_hidden_dim, Dict& vocab) {
+DependencyOutputModel::DependencyOutputModel(Model& model, Embedder* embedder, unsigned state_dim, unsigned final_hidden_dim, Dict& vocab, bool tie_embeddings) : class_softmax(nullptr), loss_sampler(nullptr), loss_sample_count(0), shortlist(nullptr) {
   assert (state_dim % 2 == 0);
   const unsigned vocab_size = vocab.size();
   half_state_dim = state_dim / 2;
@@ -43,7 +53,17 @@ DependencyOutputModel::DependencyOutputModel(Model& model, Embedder* embedder, u
   this->embedder = embedder;
   stack_lstm = LSTMBuilder(lstm_layer_count, half_state_dim, half_state_dim, model);
   comp_lstm = LSTMBuilder(lstm_layer_count, half_state_dim, half_state_dim, model);
-  final_mlp = MLP(model, 2 * half_state_dim, final_hidden_dim, vocab_size);
+  if (tie_embeddings) {
+    StandardEmbedder* standard_embedder = dynamic_cast<StandardEmbedder*>(embedder);
+    if (standard_embedder == nullptr) {
+      cerr << "Tied embeddings require a StandardEmbedder." << endl;
+      exit(1);
+    }
+    final_mlp = MLP(model, 2 * half_state_dim, final_hidden_dim, standard_embedder->Embeddings());
+  }
+  else {
+    final_mlp = MLP(model, 2 * half_state_dim, final_hidden_dim, vocab_size);
+  }
 
   emb_transform_p = model.add_parameters({half_state_dim, embedder->Dim()});
   stack_lstm_init_p = model.add_parameters({lstm_layer_count * 2 * half_state_dim});
@@ -58,28 +78,45 @@ void DependencyOutputModel::NewGraph(ComputationGraph& cg) {
   stack_lstm.new_graph(cg);
   comp_lstm.new_graph(cg);
   final_mlp.NewGraph(cg);
+  if (class_softmax != nullptr) {
+    class_softmax->NewGraph(cg);
+  }
+
+  graph.pcg = &cg;
+  if (input_table.empty()) {
+    graph.emb_transform = parameter(cg, emb_transform_p);
+  }
+  graph.stack_lstm_init = MakeLSTMInitialState(parameter(cg, stack_lstm_init_p), half_state_dim, lstm_layer_count);
+  graph.comp_lstm_init = MakeLSTMInitialState(parameter(cg, comp_lstm_init_p), half_state_dim, lstm_layer_count);
 
-  emb_transform = parameter(cg, emb_transform_p);
-  stack_lstm_init = MakeLSTMInitialState(parameter(cg, stack_lstm_init_p), half_state_dim, lstm_layer_count);
-  comp_lstm_init = MakeLSTMInitialState(parameter(cg, comp_lstm_init_p), half_state_dim, lstm_layer_count);
+  stack_lstm.start_new_sequence(graph.stack_lstm_init);
+  comp_lstm.start_new_sequence(graph.comp_lstm_init);
 
-  stack_lstm.start_new_sequence(stack_lstm_init);
-  comp_lstm.start_new_sequence(comp_lstm_init);
+  graph.prev_states.clear();
+  graph.prev_states.push_back(make_tuple(stack_lstm.state(), comp_lstm.state(), 0, true));
 
-  prev_states.clear();
-  prev_states.push_back(make_tuple(stack_lstm.state(), comp_lstm.state(), 0, true));
+  graph.head.clear();
+  graph.head.push_back((RNNPointer)-1);
 
-  head.clear();
-  head.push_back((RNNPointer)-1);
+  graph.stack.clear();
+  graph.stack.push_back((RNNPointer)-1);
 
-  stack.clear();
-  stack.push_back((RNNPointer)-1);
+  graph.last_words.clear();
+  graph.last_words.push_back(-1);
+
+  graph.negative_samples.clear();
+
+  graph.states.clear();
+  graph.hiddens.clear();
+  graph.scores.clear();
+  graph.log_distributions.clear();
+  graph.log_probabilities.clear();
 }
 
-Expression DependencyOutputModel::BuildGraph(const OutputSentence& sent) {
+Expression DependencyOutputModel::BuildGraph(const SentenceView& sent) {
   vector<Expression> losses;
   for (unsigned i = 0; i < sent.size(); ++i) {
-    const shared_ptr<const Word> word = sent[i];
+    const WordId word = sent[i];
     Expression loss = Loss(GetStatePointer(), word);
     losses.push_back(loss);
 
@@ -88,6 +125,36 @@ Expression DependencyOutputModel::BuildGraph(const OutputSentence& sent) {
   return sum(losses);
 }
 
+Expression DependencyOutputModel::BuildGraph(const vector<SentenceView>& batch) {
+  // Group together sentences whose action sequences are the same
+  map<vector<unsigned>, vector<unsigned>> groups;
+  for (unsigned i = 0; i < batch.size(); ++i) {
+    vector<unsigned> pattern(batch[i].size());
+    for (unsigned j = 0; j < batch[i].size(); ++j) {
+      unsigned wordid = batch[i][j];
+      pattern[j] = (wordid == done_with_left || wordid == done_with_right) ? wordid : (unsigned)-1;
+    }
+    groups[pattern].push_back(i);
+  }
+
+  vector<Expression> losses;
+  for (auto& group : groups) {
+    const vector<unsigned>& members = group.second;
+    const unsigned length = group.first.size();
+    RNNPointer p = (RNNPointer)0;
+    for (unsigned j = 0; j < length; ++j) {
+      vector<WordId> words(members.size());
+      for (unsigned k = 0; k < members.size(); ++k) {
+        words[k] = batch[members[k]][j];
+      }
+      losses.push_back(Loss(p, words));
+      AddInput(words, p);
+      p = GetStatePointer();
+    }
+  }
+  return sum(losses);
+}
+
 void DependencyOutputModel::SetDropout(float rate) {
   stack_lstm.set_dropout(rate);
   comp_lstm.set_dropout(rate);
@@ -95,43 +162,147 @@ void DependencyOutputModel::SetDropout(float rate) {
 }
 
 Expression DependencyOutputModel::GetState(RNNPointer p) const {
+  auto it = graph.states.find((int)p);
+  if (it != graph.states.end()) {
+    return it->second;
+  }
+
   RNNPointer stack_pointer;
   RNNPointer comp_pointer;
   unsigned stack_depth;
   bool left_done;
-  tie(stack_pointer, comp_pointer, stack_depth, left_done) = prev_states[p];
+  tie(stack_pointer, comp_pointer, stack_depth, left_done) = graph.prev_states[p];
   Expression stack_state = stack_lstm.get_h(stack_pointer).back();
   Expression comp_state = comp_lstm.get_h(comp_pointer).back();
-  return concatenate({stack_state, comp_state});
+  Expression state = concatenate({stack_state, comp_state});
+  graph.states[(int)p] = state;
+  return state;
+}
+
+Expression DependencyOutputModel::GetHidden(RNNPointer p) {
+  auto it = graph.hiddens.find((int)p);
+  if (it != graph.hiddens.end()) {
+    return it->second;
+  }
+  Expression hidden = final_mlp.Hidden(GetState(p));
+  graph.hiddens[(int)p] = hidden;
+  return hidden;
+}
+
+Expression DependencyOutputModel::GetScores(RNNPointer p) {
+  auto it = graph.scores.find((int)p);
+  if (it != graph.scores.end()) {
+    return it->second;
+  }
+  Expression scores = final_mlp.Output(GetHidden(p));
+  graph.scores[(int)p] = scores;
+  return scores;
+}
+
+const vector<float>& DependencyOutputModel::GetLogProbabilities(RNNPointer p) {
+  auto it = graph.log_probabilities.find((int)p);
+  if (it != graph.log_probabilities.end()) {
+    return it->second;
+  }
+  if (shortlist != nullptr) {
+    ComputeShortlistLogProbabilities(vector<RNNPointer>(1, p));
+    return graph.log_probabilities[(int)p];
+  }
+  return graph.log_probabilities[(int)p] = as_vector(PredictLogDistribution(p).value());
+}
+
+// The union of all the states' shortlists is scored as one batch, and then
+// each state's scores are normalized over its own shortlist only
+void DependencyOutputModel::ComputeShortlistLogProbabilities(const vector<RNNPointer>& ps) {
+  const unsigned vocab_size = shortlist->VocabSize();
+  vector<vector<unsigned>> state_rows(ps.size());
+  vector<unsigned> rows;
+  vector<int> positions(vocab_size, -1);
+  vector<Expression> hiddens;
+  for (unsigned i = 0; i < ps.size(); ++i) {
+    shortlist->Words(graph.last_words[ps[i]], state_rows[i]);
+    for (unsigned w : state_rows[i]) {
+      if (positions[w] == -1) {
+        positions[w] = rows.size();
+        rows.push_back(w);
+      }
+    }
+    hiddens.push_back(GetHidden(ps[i]));
+  }
+
+  Expression hidden = (hiddens.size() == 1) ? hiddens[0] : concatenate_to_batch(hiddens);
+  vector<float> scores = as_vector(final_mlp.Output(hidden, rows).value());
+
+  for (unsigned i = 0; i < ps.size(); ++i) {
+    const float* s = &scores[i * rows.size()];
+    float m = -numeric_limits<float>::infinity();
+    for (unsigned w : state_rows[i]) {
+      m = max(m, s[positions[w]]);
+    }
+    float z = 0.0f;
+    for (unsigned w : state_rows[i]) {
+      z += exp(s[positions[w]] - m);
+    }
+    const float log_z = m + log(z);
+
+    vector<float> log_probs(vocab_size, -numeric_limits<float>::infinity());
+    for (unsigned w : state_rows[i]) {
+      log_probs[w] = s[positions[w]] - log_z;
+    }
+    graph.log_probabilities[(int)ps[i]] = move(log_probs);
+  }
 }
 
 RNNPointer DependencyOutputModel::GetStatePointer() const {
-  return (RNNPointer)((int)prev_states.size() - 1);
+  return (RNNPointer)((int)graph.prev_states.size() - 1);
 }
 
 Expression DependencyOutputModel::AddInput(const shared_ptr<const Word> prev_word, const RNNPointer& p) {
-  assert (prev_states.size() == stack.size());
-  assert (prev_states.size() == head.size());
-  assert (p < prev_states.size());
+  return AddInput(dynamic_pointer_cast<const StandardWord>(prev_word)->id, p);
+}
 
-  unsigned wordid = dynamic_pointer_cast<const StandardWord>(prev_word)->id;
+Expression DependencyOutputModel::AddInput(WordId prev_word, const RNNPointer& p) {
+  if (!input_table.empty()) {
+    return AddInput(prev_word, input(*graph.pcg, {half_state_dim}, &input_table[prev_word]), p);
+  }
   Expression embedding = embedder->Embed(prev_word);
-  Expression transformed_embedding = emb_transform * embedding;
+  Expression transformed_embedding = graph.emb_transform * embedding;
+  return AddInput(prev_word, transformed_embedding, p);
+}
+
+Expression DependencyOutputModel::AddInput(const vector<WordId>& prev_words, const RNNPointer& p) {
+  assert (prev_words.size() > 0);
+  unsigned wordid = prev_words[0];
+  if (!input_table.empty()) {
+    vector<float> values;
+    values.reserve(prev_words.size() * half_state_dim);
+    for (WordId word : prev_words) {
+      values.insert(values.end(), input_table[word].begin(), input_table[word].end());
+    }
+    return AddInput(wordid, input(*graph.pcg, Dim({half_state_dim}, prev_words.size()), values), p);
+  }
+  Expression embeddings = embedder->Embed(prev_words);
+  Expression transformed_embeddings = graph.emb_transform * embeddings;
+  return AddInput(wordid, transformed_embeddings, p);
+}
+
+Expression DependencyOutputModel::AddInput(unsigned wordid, Expression input_vec, const RNNPointer& p) {
+  assert (graph.prev_states.size() == graph.stack.size());
+  assert (graph.prev_states.size() == graph.head.size());
+  assert (p < graph.prev_states.size());
 
   RNNPointer stack_pointer;
   RNNPointer comp_pointer;
   unsigned stack_depth;
   bool left_done;
-  tie(stack_pointer, comp_pointer, stack_depth, left_done) = prev_states[p];
+  tie(stack_pointer, comp_pointer, stack_depth, left_done) = graph.prev_states[p];
   RNNPointer parent = (RNNPointer)-1337;
 
-  Expression input_vec = transformed_embedding;
-
   if (wordid == done_with_right) {
     assert (left_done);
     Expression node_repr = comp_lstm.add_input(comp_pointer, input_vec);
 
-    RNNPointer pop_to_i = stack[p];
+    RNNPointer pop_to_i = graph.stack[p];
     if (pop_to_i == -1) {
       stack_pointer = (RNNPointer)-1;
       comp_lstm.add_input((RNNPointer)-1, node_repr);
@@ -141,7 +312,7 @@ Expression DependencyOutputModel::AddInput(const shared_ptr<const Word> prev_wor
       parent = -1;
     }
     else {
-      State& pop_to = prev_states[pop_to_i];
+      State& pop_to = graph.prev_states[pop_to_i];
 
       stack_pointer = stack_lstm.get_head(stack_pointer);
       assert (stack_pointer == get<0>(pop_to));
@@ -154,14 +325,14 @@ Expression DependencyOutputModel::AddInput(const shared_ptr<const Word> prev_wor
 
       left_done = get<3>(pop_to);
 
-      parent = stack[pop_to_i];
+      parent = graph.stack[pop_to_i];
     }
   }
   else if (wordid == done_with_left) {
     assert (!left_done);
     comp_lstm.add_input(comp_pointer, input_vec);
     comp_pointer = comp_lstm.state();
-    parent = stack[p];
+    parent = graph.stack[p];
     left_done = true;
   }
   else {
@@ -175,61 +346,120 @@ Expression DependencyOutputModel::AddInput(const shared_ptr<const Word> prev_wor
     parent = p;
   }
 
-  /*cerr << prev_states.size() << "\t" << "head: " << p << ", " << "stack: " << parent;
+  /*cerr << graph.prev_states.size() << "\t" << "head: " << p << ", " << "stack: " << parent;
   cerr << ", " << "sp: " << stack_pointer << ", " << "cp: " << comp_pointer;
   cerr << ", " << "sd: " << stack_depth << ", " << "ld: " << left_done << ", " << "word: " << word << endl;*/
-  stack.push_back(parent);
-  head.push_back(p);
-  prev_states.push_back(make_tuple(stack_pointer, comp_pointer, stack_depth, left_done));
+  graph.stack.push_back(parent);
+  graph.head.push_back(p);
+  graph.last_words.push_back(wordid);
+  graph.prev_states.push_back(make_tuple(stack_pointer, comp_pointer, stack_depth, left_done));
 
-  assert (prev_states.size() == stack.size());
-  assert (prev_states.size() == head.size());
+  assert (graph.prev_states.size() == graph.stack.size());
+  assert (graph.prev_states.size() == graph.head.size());
   return OutputModel::GetState();
 }
 
 Expression DependencyOutputModel::PredictLogDistribution(RNNPointer p) {
-  Expression state = GetState(p);
-  Expression scores = final_mlp.Feed(state);
-  Expression log_probs = log_softmax(scores);
+  auto it = graph.log_distributions.find((int)p);
+  if (it != graph.log_distributions.end()) {
+    return it->second;
+  }
+
+  Expression log_probs;
+  if (class_softmax != nullptr) {
+    log_probs = class_softmax->LogDistribution(final_mlp, GetHidden(p));
+  }
+  else {
+    log_probs = log_softmax(GetScores(p));
+  }
+  graph.log_distributions[(int)p] = log_probs;
   return log_probs;
 }
 
+// Runs the states through the output layer as a single batch, and fills in
+// the log probability cache with the results
+void DependencyOutputModel::PrecomputeLogDistributions(const vector<RNNPointer>& ps) {
+  vector<RNNPointer> todo;
+  for (RNNPointer p : ps) {
+    if (graph.log_probabilities.count((int)p) == 0 && find(todo.begin(), todo.end(), p) == todo.end()) {
+      todo.push_back(p);
+    }
+  }
+  if (shortlist != nullptr && todo.size() > 0) {
+    ComputeShortlistLogProbabilities(todo);
+    return;
+  }
+  // Class-factored distributions are left to be computed one at a time
+  if (todo.size() < 2 || class_softmax != nullptr) {
+    return;
+  }
+
+  vector<Expression> states;
+  for (RNNPointer p : todo) {
+    states.push_back(GetState(p));
+  }
+  Expression log_probs = log_softmax(final_mlp.Feed(concatenate_to_batch(states)));
+  vector<float> values = as_vector(log_probs.value());
+
+  const unsigned vocab_size = values.size() / todo.size();
+  for (unsigned i = 0; i < todo.size(); ++i) {
+    graph.log_probabilities[(int)todo[i]] = vector<float>(values.begin() + i * vocab_size, values.begin() + (i + 1) * vocab_size);
+  }
+}
+
 KBestList<shared_ptr<Word>> DependencyOutputModel::PredictKBest(RNNPointer p, unsigned K) {
-  vector<float> log_probs = as_vector(PredictLogDistribution(p).value());
-  unsigned stack_depth = get<2>(prev_states[p]);
-  bool left_done = get<3>(prev_states[p]);
+  const vector<float>& log_probs = GetLogProbabilities(p);
+  unsigned stack_depth = get<2>(graph.prev_states[p]);
+  bool left_done = get<3>(graph.prev_states[p]);
 
-  KBestList<shared_ptr<Word>> kbest(K);
-  for (unsigned i = 0; i < log_probs.size(); ++i) {
-    if (i == done_with_left && (left_done || stack_depth >= 100)) {
-      continue;
-    }
-    else if (i == done_with_right && (IsDone(p) || !left_done)) {
-      continue;
-    }
-    shared_ptr<Word> word = make_shared<StandardWord>(i);
-    kbest.add(log_probs[i], word);
+  vector<unsigned> excluded;
+  if (left_done || stack_depth >= 100) {
+    excluded.push_back(done_with_left);
+  }
+  if (IsDone(p) || !left_done) {
+    excluded.push_back(done_with_right);
   }
+  KBestList<unsigned> best_ids = TopK(log_probs.data(), log_probs.size(), K, excluded);
 
+  // Re-adding from worst to best keeps tied words in their original order
+  const auto& ids = best_ids.hypothesis_list();
+  KBestList<shared_ptr<Word>> kbest(K);
+  for (int i = (int)ids.size() - 1; i >= 0; --i) {
+    kbest.add(ids[i].first, make_shared<StandardWord>(ids[i].second));
+  }
   return kbest;
 }
 
 pair<shared_ptr<Word>, float> DependencyOutputModel::Sample(RNNPointer p) {
-  Expression state = GetState(p);
-  Expression probs = softmax(final_mlp.Feed(state));
-  vector<float> ps = as_vector(probs.value());
-
-  // Zero out the probability of illegal actions
   RNNPointer stack_pointer;
   RNNPointer comp_pointer;
   unsigned stack_depth;
   bool left_done;
-  tie(stack_pointer, comp_pointer, stack_depth, left_done) = prev_states[p];
+  tie(stack_pointer, comp_pointer, stack_depth, left_done) = graph.prev_states[p];
+  vector<unsigned> illegal;
   if (left_done || stack_depth >= 100) {
-    ps[done_with_left] = 0.0f;
+    illegal.push_back(done_with_left);
   }
   if (IsDone(p) || !left_done) {
-    ps[done_with_right] = 0.0f;
+    illegal.push_back(done_with_right);
+  }
+
+  if (class_softmax != nullptr) {
+    unsigned id;
+    float log_prob;
+    tie(id, log_prob) = class_softmax->Sample(final_mlp, GetHidden(p), illegal);
+    return make_pair(make_shared<StandardWord>(id), log_prob);
+  }
+
+  const vector<float>& log_probs = GetLogProbabilities(p);
+  vector<float> ps(log_probs.size());
+  for (unsigned i = 0; i < log_probs.size(); ++i) {
+    ps[i] = exp(log_probs[i]);
+  }
+
+  // Zero out the probability of illegal actions
+  for (unsigned i : illegal) {
+    ps[i] = 0.0f;
   }
 
   // Renormalize
@@ -247,11 +477,302 @@ pair<shared_ptr<Word>, float> DependencyOutputModel::Sample(RNNPointer p) {
 }
 
 Expression DependencyOutputModel::Loss(RNNPointer p, const shared_ptr<const Word> ref) {
-  Expression state = GetState(p);
-  Expression log_probs = final_mlp.Feed(state);
-  return pickneglogsoftmax(log_probs, dynamic_pointer_cast<const StandardWord>(ref)->id);
+  return Loss(p, dynamic_pointer_cast<const StandardWord>(ref)->id);
+}
+
+Expression DependencyOutputModel::Loss(RNNPointer p, WordId ref) {
+  if (loss_sampler != nullptr) {
+    return SampledLoss(GetHidden(p), vector<unsigned>(1, ref));
+  }
+
+  if (class_softmax != nullptr) {
+    return class_softmax->Loss(final_mlp, GetHidden(p), ref);
+  }
+
+  return pickneglogsoftmax(GetScores(p), ref);
+}
+
+Expression DependencyOutputModel::Loss(RNNPointer p, const vector<WordId>& refs) {
+  vector<unsigned> ref_ids(refs.begin(), refs.end());
+
+  // The initial state is built by NewGraph before the batch size is known,
+  // so it is unbatched. Every group in a batch starts there, and its hidden
+  // layer has to be copied once per member.
+  Expression hidden = GetHidden(p);
+  const bool broadcast = refs.size() > 1 && graph.pcg->get_dimension(hidden.i).bd == 1;
+  if (broadcast) {
+    hidden = concatenate_to_batch(vector<Expression>(refs.size(), hidden));
+  }
+
+  if (loss_sampler != nullptr) {
+    return sum_batches(SampledLoss(hidden, ref_ids));
+  }
+
+  if (class_softmax != nullptr) {
+    return class_softmax->Loss(final_mlp, hidden, ref_ids);
+  }
+
+  Expression scores = broadcast ? final_mlp.Output(hidden) : GetScores(p);
+  return sum_batches(pickneglogsoftmax(scores, ref_ids));
+}
+
+void DependencyOutputModel::UseClassFactoredSoftmax(Model& model, const vector<unsigned>& word_counts, unsigned class_count) {
+  assert (class_softmax == nullptr);
+  vector<unsigned> singletons = {done_with_left, done_with_right};
+  class_softmax = new ClassFactoredSoftmax(model, final_mlp.HiddenDim(), word_counts, class_count, singletons);
+}
+
+void DependencyOutputModel::SetShortlist(const Shortlist* shortlist) {
+  if (shortlist != nullptr && class_softmax != nullptr) {
+    cerr << "Shortlists are not supported with a class-factored softmax." << endl;
+    exit(1);
+  }
+  if (shortlist != nullptr && shortlist->VocabSize() != VocabSize()) {
+    cerr << "The shortlist was built for a vocabulary of " << shortlist->VocabSize() << " words, but the model has " << VocabSize() << "." << endl;
+    exit(1);
+  }
+  this->shortlist = shortlist;
+}
+
+vector<vector<float>> DependencyOutputModel::ComputeInputs(const vector<WordId>& words) {
+  ComputationGraph cg;
+  embedder->NewGraph(cg);
+  Expression transformed = parameter(cg, emb_transform_p) * embedder->Embed(words);
+  vector<float> values = as_vector(cg.forward(transformed));
+  assert (values.size() == words.size() * half_state_dim);
+
+  vector<vector<float>> inputs(words.size());
+  for (unsigned i = 0; i < words.size(); ++i) {
+    inputs[i].assign(values.begin() + i * half_state_dim, values.begin() + (i + 1) * half_state_dim);
+  }
+  return inputs;
+}
+
+// Reads input_table from a cache file, and checks a few of its entries
+// against freshly computed ones in case the model has changed since
+bool DependencyOutputModel::ReadInputCache(const string& filename) {
+  const unsigned vocab_size = VocabSize();
+  ifstream f(filename, ios::binary);
+  if (!f.is_open()) {
+    return false;
+  }
+  unsigned dim;
+  boost::archive::binary_iarchive ia(f);
+  ia & dim;
+  ia & input_table;
+  if (dim != half_state_dim || input_table.size() != vocab_size) {
+    input_table.clear();
+    return false;
+  }
+
+  const unsigned check_count = min(vocab_size, 16U);
+  vector<WordId> words(check_count);
+  for (unsigned i = 0; i < check_count; ++i) {
+    words[i] = (WordId)((unsigned long)i * vocab_size / check_count);
+  }
+  vector<vector<float>> expected = ComputeInputs(words);
+  for (unsigned i = 0; i < check_count; ++i) {
+    for (unsigned j = 0; j < half_state_dim; ++j) {
+      if (fabs(input_table[words[i]][j] - expected[i][j]) > 1.0e-4f * (1.0f + fabs(expected[i][j]))) {
+        input_table.clear();
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+unsigned DependencyOutputModel::VocabSize() const {
+  return final_mlp.OutputDim();
+}
+
+void DependencyOutputModel::PrecomputeInputs(const string& cache_filename) {
+  const unsigned vocab_size = VocabSize();
+  input_table.clear();
+  if (!cache_filename.empty()) {
+    if (ReadInputCache(cache_filename)) {
+      return;
+    }
+    cerr << "Input cache " << cache_filename << " is missing or out of date, rebuilding it." << endl;
+  }
+
+  const unsigned chunk_size = 1024;
+  input_table.reserve(vocab_size);
+  for (unsigned start = 0; start < vocab_size; start += chunk_size) {
+    vector<WordId> words;
+    for (unsigned w = start; w < min(vocab_size, start + chunk_size); ++w) {
+      words.push_back(w);
+    }
+    vector<vector<float>> inputs = ComputeInputs(words);
+    for (vector<float>& v : inputs) {
+      input_table.push_back(move(v));
+    }
+  }
+
+  if (!cache_filename.empty()) {
+    ofstream f(cache_filename, ios::binary);
+    boost::archive::binary_oarchive oa(f);
+    oa & half_state_dim;
+    oa & input_table;
+  }
+}
+
+bool DependencyOutputModel::HasPrecomputedInputs() const {
+  return !input_table.empty();
+}
+
+void DependencyOutputModel::SetLossSampler(const AliasSampler* sampler, unsigned sample_count) {
+  assert (sampler == nullptr || sample_count > 0);
+  loss_sampler = sampler;
+  loss_sample_count = sample_count;
+}
+
+// Sampled softmax loss. If hidden is batched, there must be one reference per
+// batch element, and the references of the other batch elements serve as
+// additional negative samples for each one.
+Expression DependencyOutputModel::SampledLoss(Expression hidden, const vector<unsigned>& refs) {
+  if (graph.negative_samples.size() == 0) {
+    unordered_set<unsigned> seen;
+    for (unsigned i = 0; i < loss_sample_count; ++i) {
+      unsigned w = loss_sampler->Draw();
+      if (seen.insert(w).second) {
+        graph.negative_samples.push_back(w);
+      }
+    }
+  }
+
+  // Score the distinct references first, followed by the negative samples
+  vector<unsigned> rows;
+  vector<unsigned> ref_positions(refs.size());
+  for (unsigned i = 0; i < refs.size(); ++i) {
+    auto it = find(rows.begin(), rows.end(), refs[i]);
+    ref_positions[i] = it - rows.begin();
+    if (it == rows.end()) {
+      rows.push_back(refs[i]);
+    }
+  }
+  const unsigned ref_count = rows.size();
+  for (unsigned w : graph.negative_samples) {
+    if (find(rows.begin(), rows.begin() + ref_count, w) == rows.begin() + ref_count) {
+      rows.push_back(w);
+    }
+  }
+
+  // Correct each score by the log of the probability that its word appears
+  // in the (de-duplicated) set of samples
+  vector<float> corrections(rows.size());
+  for (unsigned i = 0; i < rows.size(); ++i) {
+    double q = loss_sampler->Probability(rows[i]);
+    double expected_count = -expm1(loss_sample_count * log1p(-q));
+    corrections[i] = -log(max(expected_count, 1.0e-20));
+  }
+
+  Expression scores = final_mlp.Output(hidden, rows) + input(*graph.pcg, {(unsigned)rows.size()}, corrections);
+  if (refs.size() == 1) {
+    return pickneglogsoftmax(scores, ref_positions[0]);
+  }
+  else {
+    return pickneglogsoftmax(scores, ref_positions);
+  }
 }
 
 bool DependencyOutputModel::IsDone(RNNPointer p) const {
-  return (get<2>(prev_states[p]) == (unsigned)-1);
+  return (get<2>(graph.prev_states[p]) == (unsigned)-1);
+}
+
+// A live state depends on the states it would return to on </RIGHT> (its
+// chain of graph.stack entries), on the stack LSTM nodes of all of those
+// (and their heads), and on their comp LSTM nodes. The values of those LSTM
+// nodes are copied out, the graph is cleared, and each node is recreated
+// as an input with set_s(). Old indices are visited in increasing order,
+// so heads and pop targets are always rebuilt before the states that use
+// them.
+vector<RNNPointer> DependencyOutputModel::Compact(const vector<RNNPointer>& live) {
+  set<int> states;
+  for (RNNPointer p : live) {
+    for (int q = (int)p; q != -1 && states.insert(q).second; q = (int)graph.stack[q]) {}
+  }
+
+  set<int> stack_nodes;
+  set<int> comp_nodes;
+  for (int q : states) {
+    for (int s = (int)get<0>(graph.prev_states[q]); s != -1 && stack_nodes.insert(s).second; s = (int)stack_lstm.get_head((RNNPointer)s)) {}
+    int c = (int)get<1>(graph.prev_states[q]);
+    if (c != -1) {
+      comp_nodes.insert(c);
+    }
+  }
+
+  auto save = [](const LSTMBuilder& lstm, int node) {
+    vector<vector<float>> values;
+    for (Expression e : lstm.get_s((RNNPointer)node)) {
+      values.push_back(as_vector(e.value()));
+    }
+    return values;
+  };
+
+  map<int, vector<vector<float>>> stack_values;
+  map<int, int> stack_heads;
+  for (int s : stack_nodes) {
+    stack_values[s] = save(stack_lstm, s);
+    stack_heads[s] = (int)stack_lstm.get_head((RNNPointer)s);
+  }
+  map<int, vector<vector<float>>> comp_values;
+  for (int c : comp_nodes) {
+    comp_values[c] = save(comp_lstm, c);
+  }
+
+  vector<State> old_states = move(graph.prev_states);
+  vector<RNNPointer> old_stack = move(graph.stack);
+  vector<RNNPointer> old_head = move(graph.head);
+  vector<WordId> old_last_words = move(graph.last_words);
+
+  ComputationGraph& cg = *graph.pcg;
+  cg.clear();
+  NewGraph(cg);
+
+  auto load = [&](const vector<vector<float>>& values) {
+    vector<Expression> s;
+    for (const vector<float>& v : values) {
+      s.push_back(input(cg, {(unsigned)v.size()}, v));
+    }
+    return s;
+  };
+
+  map<int, int> stack_map = {{-1, -1}};
+  for (auto& node : stack_values) {
+    stack_lstm.set_s((RNNPointer)stack_map[stack_heads[node.first]], load(node.second));
+    stack_map[node.first] = (int)stack_lstm.state();
+  }
+  map<int, int> comp_map = {{-1, -1}};
+  for (auto& node : comp_values) {
+    comp_lstm.set_s((RNNPointer)-1, load(node.second));
+    comp_map[node.first] = (int)comp_lstm.state();
+  }
+
+  // NewGraph has already recreated the initial state as state 0
+  map<int, int> state_map = {{-1, -1}, {0, 0}};
+  for (int q : states) {
+    if (q == 0) {
+      continue;
+    }
+    RNNPointer stack_pointer;
+    RNNPointer comp_pointer;
+    unsigned stack_depth;
+    bool left_done;
+    tie(stack_pointer, comp_pointer, stack_depth, left_done) = old_states[q];
+
+    int head = state_map.count((int)old_head[q]) ? state_map[(int)old_head[q]] : -1;
+    state_map[q] = (int)graph.prev_states.size();
+    graph.prev_states.push_back(make_tuple((RNNPointer)stack_map[(int)stack_pointer], (RNNPointer)comp_map[(int)comp_pointer], stack_depth, left_done));
+    graph.stack.push_back((RNNPointer)state_map[(int)old_stack[q]]);
+    graph.head.push_back((RNNPointer)head);
+    graph.last_words.push_back(old_last_words[q]);
+  }
+
+  vector<RNNPointer> r;
+  for (RNNPointer p : live) {
+    r.push_back((RNNPointer)state_map[(int)p]);
+  }
+  return r;
 }
@@ -1,11 +1,15 @@
 #pragma once
 #include <boost/serialization/access.hpp>
+#include <boost/serialization/version.hpp>
+#include <unordered_map>
 #include "dynet/dynet.h"
 #include "dynet/rnn.h"
 #include "embedder.h"
 #include "kbestlist.h"
 #include "utils.h"
 #include "mlp.h"
+#include "softmax.h"
+#include "shortlist.h"
 
 class OutputModel {
 public:
@@ -21,6 +25,9 @@ public:
 
   virtual Expression PredictLogDistribution();
   virtual Expression PredictLogDistribution(RNNPointer p) = 0;
+  // Hint that the distributions at all of these states are about to be
+  // needed, so that a model may compute them together
+  virtual void PrecomputeLogDistributions(const vector<RNNPointer>& ps) {}
   virtual KBestList<shared_ptr<Word>> PredictKBest(unsigned K);
   virtual KBestList<shared_ptr<Word>> PredictKBest(RNNPointer p, unsigned K) = 0;
   virtual pair<shared_ptr<Word>, float> Sample();
@@ -31,6 +38,12 @@ public:
   virtual bool IsDone() const;
   virtual bool IsDone(RNNPointer p) const = 0;
 
+  // Discards every state that the given live states no longer depend on,
+  // rebuilding the current computation graph from scratch with only what
+  // remains. Returns the new pointers of the live states, in order. All
+  // other state pointers and expressions from before the call are invalid.
+  virtual vector<RNNPointer> Compact(const vector<RNNPointer>& live);
+
 private:
   friend class boost::serialization::access;
   template<class Archive>
@@ -40,9 +53,15 @@ private:
 class DependencyOutputModel : public OutputModel {
 public:
   DependencyOutputModel();
-  DependencyOutputModel(Model& model, Embedder* embedder, unsigned state_dim, unsigned final_hidden_dim, Dict& vocab);
+  // If tie_embeddings is set, the output layer reuses the embedder's word
+  // embeddings, which must then come from a StandardEmbedder
+  DependencyOutputModel(Model& model, Embedder* embedder, unsigned state_dim, unsigned final_hidden_dim, Dict& vocab, bool tie_embeddings = false);
 
-  Expression BuildGraph(const OutputSentence& sent);
+  Expression BuildGraph(const SentenceView& sent);
+  // Builds the summed loss of several sentences in one graph. Sentences with
+  // identical sequences of </LEFT> and </RIGHT> actions have identically
+  // shaped trees, so each such group is run as a single batched sequence.
+  Expression BuildGraph(const vector<SentenceView>& batch);
 
   void NewGraph(ComputationGraph& cg) override;
   void SetDropout(float rate) override;
@@ -51,38 +70,121 @@ public:
   Expression AddInput(const shared_ptr<const Word> prev_word, const RNNPointer& p) override;
 
   Expression PredictLogDistribution(RNNPointer p) override;
+  void PrecomputeLogDistributions(const vector<RNNPointer>& ps) override;
   KBestList<shared_ptr<Word>> PredictKBest(RNNPointer p, unsigned K) override;
   pair<shared_ptr<Word>, float> Sample(RNNPointer p) override;
   Expression Loss(RNNPointer p, const shared_ptr<const Word> ref) override;
   bool IsDone(RNNPointer p) const override;
+  vector<RNNPointer> Compact(const vector<RNNPointer>& live) override;
+
+  // Versions of AddInput and Loss that take word ids directly
+  Expression AddInput(WordId prev_word, const RNNPointer& p);
+  Expression Loss(RNNPointer p, WordId ref);
+
+  // Batched versions of AddInput and Loss. All words in the batch must have
+  // the same structural role (i.e. all </LEFT>, all </RIGHT>, or all neither).
+  Expression AddInput(const vector<WordId>& prev_words, const RNNPointer& p);
+  Expression Loss(RNNPointer p, const vector<WordId>& refs);
+
+  // Replaces the full softmax output layer with a class-factored one, whose
+  // classes are built from the given word frequencies. The structural words
+  // </LEFT> and </RIGHT> get classes of their own, so that they can be
+  // masked out without touching the rest of the distribution.
+  void UseClassFactoredSoftmax(Model& model, const vector<unsigned>& word_counts, unsigned class_count);
+
+  // Switches Loss() to a sampled softmax, for training with large
+  // vocabularies. Once per graph, sample_count words are drawn from sampler,
+  // and each call to Loss() only scores those and the reference words.
+  // Pass a null sampler to go back to the full softmax.
+  void SetLossSampler(const AliasSampler* sampler, unsigned sample_count);
+
+  // Restricts PredictKBest and Sample to the given shortlist, so that only
+  // its rows of the output layer are computed. Loss and
+  // PredictLogDistribution always use the full vocabulary. Pass null to go
+  // back to the full vocabulary. Not supported with a class-factored softmax.
+  void SetShortlist(const Shortlist* shortlist);
+
+  // The number of words the model was built with. The vocabulary may have
+  // grown past this since (e.g. by appending "UNK"), so any word id from the
+  // Dict must be checked against it before being used as an index.
+  unsigned VocabSize() const;
+
+  // For inference only: computes emb_transform * Embed(w) once for each of
+  // the VocabSize() words, so that AddInput is a single table lookup rather
+  // than a lookup and a matrix-vector product. The table is stale as soon as
+  // any parameter changes. If cache_filename is not empty, the table is read
+  // from that file when it holds a copy that still matches the model, and
+  // is written there otherwise. Must be called before NewGraph.
+  void PrecomputeInputs(const string& cache_filename = "");
+  bool HasPrecomputedInputs() const;
 
 private:
+  Expression AddInput(unsigned wordid, Expression input_vec, const RNNPointer& p);
+  Expression SampledLoss(Expression hidden, const vector<unsigned>& refs);
+  // emb_transform * Embed(w) for each of words, computed in a graph of its own
+  vector<vector<float>> ComputeInputs(const vector<WordId>& words);
+  bool ReadInputCache(const string& filename);
+
+  // Memoized views of the output layer at state p. Each is built (and, for
+  // the log probabilities, evaluated) at most once per graph.
+  Expression GetHidden(RNNPointer p);
+  Expression GetScores(RNNPointer p);
+  const vector<float>& GetLogProbabilities(RNNPointer p);
+  // Fills in the log probability cache for each state, restricted to its
+  // shortlist
+  void ComputeShortlistLogProbabilities(const vector<RNNPointer>& ps);
+
   typedef tuple<RNNPointer, RNNPointer, unsigned, bool> State; // Stack pointer, comp pointer, stack depth, done with left
 
   Embedder* embedder;
   LSTMBuilder stack_lstm;
   LSTMBuilder comp_lstm;
   MLP final_mlp;
+  ClassFactoredSoftmax* class_softmax; // If not null, replaces the softmax over final_mlp's output
 
   Parameter emb_transform_p; // Simple linear transform from word embedding space to state space
   Parameter stack_lstm_init_p;
   Parameter comp_lstm_init_p;
 
-  Expression emb_transform;
-  vector<Expression> stack_lstm_init;
-  vector<Expression> comp_lstm_init;
-
   unsigned half_state_dim;
   unsigned done_with_left;
   unsigned done_with_right;
 
-  vector<State> prev_states;
-  vector<RNNPointer> stack; // From each state, if you were to see </RIGHT> where would you go back to?
-  vector<RNNPointer> head;
-
+  const AliasSampler* loss_sampler;
+  unsigned loss_sample_count;
+  const Shortlist* shortlist;
+  vector<vector<float>> input_table; // From PrecomputeInputs, indexed by word id
+
+  // Decoding state belonging to the current computation graph. NewGraph
+  // rebuilds all of it, and none of it is ever written back to the shared
+  // parameters above.
+  struct GraphState {
+    ComputationGraph* pcg;
+    Expression emb_transform;
+    vector<Expression> stack_lstm_init;
+    vector<Expression> comp_lstm_init;
+
+    vector<State> prev_states;
+    vector<RNNPointer> stack; // From each state, if you were to see </RIGHT> where would you go back to?
+    vector<RNNPointer> head;
+    vector<WordId> last_words; // The word that led to each state, or -1
+
+    vector<unsigned> negative_samples; // Drawn from loss_sampler on first use
+
+    // Caches keyed by state pointer, so that Loss, PredictKBest, Sample, etc.
+    // asked about the same state share one copy of the output layer
+    mutable unordered_map<int, Expression> states;
+    unordered_map<int, Expression> hiddens;
+    unordered_map<int, Expression> scores;
+    unordered_map<int, Expression> log_distributions;
+    unordered_map<int, vector<float>> log_probabilities;
+  };
+  GraphState graph;
+
+  friend class NativeModel;
   friend class boost::serialization::access;
   template<class Archive>
-  void serialize(Archive& ar, const unsigned int) {
+  void serialize(Archive& ar, const unsigned int version) {
     ar & boost::serialization::base_object<OutputModel>(*this);
     ar & embedder;
     ar & stack_lstm;
@@ -96,6 +198,11 @@ private:
     ar & half_state_dim;
     ar & done_with_left;
     ar & done_with_right;
+
+    if (version >= 1) {
+      ar & class_softmax;
+    }
   }
 };
 BOOST_CLASS_EXPORT_KEY(DependencyOutputModel)
+BOOST_CLASS_VERSION(DependencyOutputModel, 1)
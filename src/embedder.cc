@@ -18,6 +18,10 @@ void StandardEmbedder::NewGraph(ComputationGraph& cg) {
 
 void StandardEmbedder::SetDropout(float) {}
 
+LookupParameter StandardEmbedder::Embeddings() const {
+  return embeddings;
+}
+
 unsigned StandardEmbedder::Dim() const {
   return emb_dim;
 }
@@ -25,5 +29,14 @@ unsigned StandardEmbedder::Dim() const {
 Expression StandardEmbedder::Embed(const shared_ptr<const Word> word) {
   const shared_ptr<const StandardWord> standard_word = dynamic_pointer_cast<const StandardWord>(word);
   assert (standard_word != nullptr);
-  return lookup(*pcg, embeddings, standard_word->id);
+  return Embed(standard_word->id);
+}
+
+Expression StandardEmbedder::Embed(WordId word) {
+  return lookup(*pcg, embeddings, word);
+}
+
+Expression StandardEmbedder::Embed(const vector<WordId>& words) {
+  vector<unsigned> ids(words.begin(), words.end());
+  return lookup(*pcg, embeddings, ids);
 }
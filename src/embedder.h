@@ -18,6 +18,8 @@ public:
   virtual void SetDropout(float rate);
   virtual unsigned Dim() const = 0;
   virtual Expression Embed(const shared_ptr<const Word> word) = 0;
+  virtual Expression Embed(WordId word) = 0;
+  virtual Expression Embed(const vector<WordId>& words) = 0;
 private:
   friend class boost::serialization::access;
   template<class Archive>
@@ -33,11 +35,15 @@ public:
   void SetDropout(float rate) override;
   unsigned Dim() const override;
   Expression Embed(const shared_ptr<const Word> word) override;
+  Expression Embed(WordId word) override;
+  Expression Embed(const vector<WordId>& words) override;
+  LookupParameter Embeddings() const;
 private:
   unsigned emb_dim;
   LookupParameter embeddings;
   ComputationGraph* pcg;
 
+  friend class NativeModel;
   friend class boost::serialization::access;
   template<class Archive>
   void serialize(Archive& ar, const unsigned int) {
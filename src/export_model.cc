@@ -0,0 +1,72 @@
+#include <iostream>
+#include <fstream>
+#include <boost/program_options.hpp>
+#include "deplm.h"
+#include "utils.h"
+#include "io.h"
+
+using namespace dynet;
+using namespace std;
+namespace po = boost::program_options;
+
+// Writes an inference-only copy of a trained model, optionally with its
+// parameters stored in 16 bits. loss, sample and predict read the result
+// just like any other model file.
+int main(int argc, char** argv) {
+  dynet::initialize(argc, argv, true);
+
+  po::options_description desc("description");
+  desc.add_options()
+  ("help", "Display this help message")
+  ("model", po::value<string>()->required(), "Trained model")
+  ("output", po::value<string>()->required(), "Output model file")
+  ("precision", po::value<string>()->default_value("fp16"), "How to store parameters: fp32, fp16 or bf16");
+
+  po::positional_options_description positional_options;
+  positional_options.add("model", 1);
+  positional_options.add("output", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(positional_options).run(), vm);
+
+  if (vm.count("help")) {
+    cerr << desc;
+    return 1;
+  }
+
+  po::notify(vm);
+
+  Precision precision;
+  const string precision_name = vm["precision"].as<string>();
+  if (precision_name == "fp32") {
+    precision = Precision::FP32;
+  }
+  else if (precision_name == "fp16") {
+    precision = Precision::FP16;
+  }
+  else if (precision_name == "bf16") {
+    precision = Precision::BF16;
+  }
+  else {
+    cerr << "Invalid parameters: --precision must be one of fp32, fp16 and bf16." << endl;
+    return 1;
+  }
+
+  Dict vocab;
+  Model dynet_model;
+  DependencyOutputModel model;
+  Trainer* trainer = nullptr;
+  Deserialize(vm["model"].as<string>(), vocab, model, dynet_model, trainer);
+
+  const string output_filename = vm["output"].as<string>();
+  ofstream f(output_filename, ios::binary);
+  SerializeForInference(f, vocab, model, dynet_model, precision);
+  f.close();
+  if (!f) {
+    cerr << "Unable to write " << output_filename << "." << endl;
+    return 1;
+  }
+
+  cerr << "Wrote " << dynet_model.parameter_count() << " parameters as " << precision_name << "." << endl;
+  return 0;
+}
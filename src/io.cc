@@ -1,20 +1,240 @@
 #include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/stream.hpp>
+#include <boost/serialization/vector.hpp>
+#include "dynet/devices.h"
 #include "io.h"
 
+// 16 bit files start with these bytes, followed by one byte of Precision
+// and then a boost archive. Boost's own archive header never begins this way.
+const char kReducedPrecisionMagic[8] = {'D', 'E', 'P', 'L', 'M', '1', '6', '\n'};
+
+uint16_t FloatToHalf(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  const uint32_t sign = (x >> 16) & 0x8000;
+  uint32_t mantissa = x & 0x7fffff;
+  if (((x >> 23) & 0xff) == 0xff) {
+    return sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0);
+  }
+
+  const int exponent = (int)((x >> 23) & 0xff) - 127 + 15;
+  if (exponent >= 31) {
+    return sign | 0x7c00;
+  }
+  if (exponent < -10) {
+    return sign;
+  }
+
+  // Round to nearest, ties to even. A carry out of the mantissa correctly
+  // bumps the exponent.
+  uint32_t half;
+  unsigned shift;
+  if (exponent <= 0) {
+    mantissa |= 0x800000;
+    shift = 14 - exponent;
+    half = mantissa >> shift;
+  }
+  else {
+    shift = 13;
+    half = ((uint32_t)exponent << 10) | (mantissa >> shift);
+  }
+  const uint32_t rest = mantissa & ((1u << shift) - 1);
+  const uint32_t halfway = 1u << (shift - 1);
+  if (rest > halfway || (rest == halfway && (half & 1))) {
+    half++;
+  }
+  return sign | half;
+}
+
+float HalfToFloat(uint16_t h) {
+  const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t x;
+  if (exponent == 0x1f) {
+    x = sign | 0x7f800000 | (mantissa << 13);
+  }
+  else if (exponent != 0) {
+    x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  }
+  else if (mantissa == 0) {
+    x = sign;
+  }
+  else {
+    // Subnormal, so renormalize
+    exponent = 127 - 15 + 1;
+    while ((mantissa & 0x400) == 0) {
+      mantissa <<= 1;
+      exponent--;
+    }
+    x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+uint16_t FloatToBfloat16(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  if ((x & 0x7fffffff) > 0x7f800000) {
+    return (x >> 16) | 0x40;
+  }
+  // Round to nearest, ties to even
+  return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+float Bfloat16ToFloat(uint16_t b) {
+  const uint32_t x = (uint32_t)b << 16;
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+// Every tensor of parameter values in a model, in a fixed order
+vector<Tensor*> ValueTensors(Model& dynet_model) {
+  vector<Tensor*> tensors;
+  for (ParameterStorage* p : dynet_model.parameters_list()) {
+    tensors.push_back(&p->values);
+  }
+  for (LookupParameterStorage* p : dynet_model.lookup_parameters_list()) {
+    tensors.push_back(&p->all_values);
+  }
+  return tensors;
+}
+
+// The tensors that SerializeForInference leaves out of the archive
+vector<Tensor*> OmittedTensors(Model& dynet_model) {
+  vector<Tensor*> tensors = ValueTensors(dynet_model);
+  for (ParameterStorage* p : dynet_model.parameters_list()) {
+    tensors.push_back(&p->g);
+  }
+  for (LookupParameterStorage* p : dynet_model.lookup_parameters_list()) {
+    tensors.push_back(&p->all_grads);
+  }
+  return tensors;
+}
+
+// Gives every tensor that was loaded empty by DeserializeReducedPrecision
+// its full size again. Lookup parameters' per-word tensors are views into
+// their one big tensor, so they have to be pointed at the new memory.
+void ReallocateOmittedTensors(Model& dynet_model) {
+  for (ParameterStorage* p : dynet_model.parameters_list()) {
+    for (Tensor* t : {&p->values, &p->g}) {
+      t->d = p->dim;
+      default_device->allocate_tensor(DeviceMempool::PS, *t);
+    }
+    TensorTools::Zero(p->g);
+  }
+  for (LookupParameterStorage* p : dynet_model.lookup_parameters_list()) {
+    for (Tensor* t : {&p->all_values, &p->all_grads}) {
+      t->d = p->all_dim;
+      default_device->allocate_tensor(DeviceMempool::PS, *t);
+    }
+    TensorTools::Zero(p->all_grads);
+    for (unsigned i = 0; i < p->values.size(); ++i) {
+      p->values[i].v = p->all_values.v + i * p->dim.size();
+      p->grads[i].v = p->all_grads.v + i * p->dim.size();
+    }
+  }
+}
+
 void Serialize(Dict& vocab, const DependencyOutputModel& model, Model& dynet_model, const Trainer* const trainer) {
   int r = ftruncate(fileno(stdout), 0);
   if (r != 0) {}
   fseek(stdout, 0, SEEK_SET);
 
-  boost::archive::binary_oarchive oa(cout);
+  Serialize(cout, vocab, model, dynet_model, trainer);
+}
+
+void Serialize(ostream& os, Dict& vocab, const DependencyOutputModel& model, Model& dynet_model, const Trainer* const trainer) {
+  boost::archive::binary_oarchive oa(os);
   oa & dynet_model;
   oa & vocab;
   oa & model;
   oa & trainer;
 }
 
+// Parameter values are converted to 16 bits up front. Then every tensor is
+// made to look empty while the model is archived, so that the archive holds
+// only the model's structure, and the 16 bit values are appended after it.
+void SerializeForInference(ostream& os, Dict& vocab, const DependencyOutputModel& model, Model& dynet_model, Precision precision) {
+  if (precision == Precision::FP32) {
+    Serialize(os, vocab, model, dynet_model, nullptr);
+    return;
+  }
+
+  vector<uint16_t> values;
+  for (Tensor* t : ValueTensors(dynet_model)) {
+    for (unsigned i = 0; i < t->d.size(); ++i) {
+      values.push_back(precision == Precision::FP16 ? FloatToHalf(t->v[i]) : FloatToBfloat16(t->v[i]));
+    }
+  }
+
+  vector<Tensor*> tensors = OmittedTensors(dynet_model);
+  vector<Dim> dims;
+  for (Tensor* t : tensors) {
+    dims.push_back(t->d);
+    t->d = Dim({0});
+  }
+
+  os.write(kReducedPrecisionMagic, sizeof(kReducedPrecisionMagic));
+  os.put((char)precision);
+  {
+    boost::archive::binary_oarchive oa(os);
+    const Trainer* const trainer = nullptr;
+    oa & dynet_model;
+    oa & vocab;
+    oa & model;
+    oa & trainer;
+    oa & values;
+  }
+
+  for (unsigned i = 0; i < tensors.size(); ++i) {
+    tensors[i]->d = dims[i];
+  }
+}
+
+void DeserializeReducedPrecision(istream& is, Dict& vocab, DependencyOutputModel& model, Model& dynet_model, Trainer*& trainer) {
+  const Precision precision = (Precision)is.get();
+  assert (precision == Precision::FP16 || precision == Precision::BF16);
+
+  vector<uint16_t> values;
+  boost::archive::binary_iarchive ia(is);
+  ia & dynet_model;
+  ia & vocab;
+  ia & model;
+  ia & trainer;
+  ia & values;
+
+  ReallocateOmittedTensors(dynet_model);
+  unsigned i = 0;
+  for (Tensor* t : ValueTensors(dynet_model)) {
+    assert (i + t->d.size() <= values.size());
+    for (unsigned j = 0; j < t->d.size(); ++j) {
+      t->v[j] = (precision == Precision::FP16) ? HalfToFloat(values[i++]) : Bfloat16ToFloat(values[i++]);
+    }
+  }
+  assert (i == values.size());
+}
+
 void Deserialize(const string& filename, Dict& vocab, DependencyOutputModel& model, Model& dynet_model, Trainer*& trainer) {
   ifstream f(filename);
+  char magic[sizeof(kReducedPrecisionMagic)];
+  if (f.read(magic, sizeof(magic)) && memcmp(magic, kReducedPrecisionMagic, sizeof(magic)) == 0) {
+    DeserializeReducedPrecision(f, vocab, model, dynet_model, trainer);
+    f.close();
+    return;
+  }
+  f.clear();
+  f.seekg(0);
+
   boost::archive::binary_iarchive ia(f);
   ia & dynet_model;
   ia & vocab;
@@ -22,3 +242,61 @@ void Deserialize(const string& filename, Dict& vocab, DependencyOutputModel& mod
   ia & trainer;
   f.close();
 }
+
+AsyncCheckpointer::AsyncCheckpointer(const string& filename) : filename(filename) {}
+
+AsyncCheckpointer::~AsyncCheckpointer() {
+  Wait();
+}
+
+void AsyncCheckpointer::Wait() {
+  if (writer.joinable()) {
+    writer.join();
+  }
+}
+
+void AsyncCheckpointer::Save(Dict& vocab, const DependencyOutputModel& model, Model& dynet_model, const Trainer* const trainer) {
+  // Archived straight into the buffer, rather than into a stringstream
+  // whose contents would then have to be copied out again
+  shared_ptr<string> buffer = make_shared<string>();
+  {
+    boost::iostreams::stream<boost::iostreams::back_insert_device<string>> os(*buffer);
+    Serialize(os, vocab, model, dynet_model, trainer);
+  }
+
+  // Only one write is ever in flight. If the previous one is somehow still
+  // going we have to wait for it, lest the two race on the temporary file.
+  Wait();
+
+  const string filename = this->filename;
+  writer = thread([buffer, filename]() {
+    const string temp_filename = filename + ".tmp";
+    FILE* f = fopen(temp_filename.c_str(), "wb");
+    if (f == nullptr) {
+      cerr << "Unable to open " << temp_filename << " for writing." << endl;
+      return;
+    }
+
+    bool ok = (fwrite(buffer->data(), 1, buffer->size(), f) == buffer->size());
+    ok = (fflush(f) == 0) && ok;
+    ok = (fsync(fileno(f)) == 0) && ok;
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(temp_filename.c_str(), filename.c_str()) != 0) {
+      cerr << "Unable to write checkpoint to " << filename << "." << endl;
+      remove(temp_filename.c_str());
+      return;
+    }
+
+    // The rename itself only survives a crash once the directory is synced
+    const size_t slash = filename.find_last_of('/');
+    const string directory = (slash == string::npos) ? "." : (slash == 0) ? "/" : filename.substr(0, slash);
+    int dir_fd = open(directory.c_str(), O_RDONLY);
+    if (dir_fd < 0 || fsync(dir_fd) != 0) {
+      cerr << "Unable to sync " << directory << " after writing checkpoint to " << filename << "." << endl;
+    }
+    if (dir_fd >= 0) {
+      close(dir_fd);
+    }
+  });
+}
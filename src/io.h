@@ -4,8 +4,10 @@
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/serialization/base_object.hpp>
+#include <cstdint>
 #include <vector>
 #include <functional>
+#include <thread>
 #include "dynet/dict.h"
 #include "dynet/training.h"
 #include "deplm.h"
@@ -16,4 +18,38 @@ using namespace dynet;
 
 
 void Serialize(Dict& vocab, const DependencyOutputModel& model, Model& dynet_model, const Trainer* const trainer);
+void Serialize(ostream& os, Dict& vocab, const DependencyOutputModel& model, Model& dynet_model, const Trainer* const trainer);
+// Reads a model written by either Serialize or SerializeForInference.
+// Reduced precision parameters are expanded back to floats, and models
+// saved for inference come back with a null trainer and zeroed gradients.
 void Deserialize(const string& filename, Dict& vocab, DependencyOutputModel& model, Model& dynet_model, Trainer*& trainer);
+
+// How SerializeForInference stores parameter values
+enum class Precision : uint8_t { FP32, FP16, BF16 };
+
+// Writes a copy of a model for inference only: the trainer's state is left
+// out, and with FP16 or BF16 every parameter is rounded to 16 bits, halving
+// the file. Gradients are never written in 16 bit files.
+void SerializeForInference(ostream& os, Dict& vocab, const DependencyOutputModel& model, Model& dynet_model, Precision precision);
+
+// Saves models to a named file without stalling the caller.
+// Save() serializes the model into an in-memory buffer, which is the only
+// part that has to happen while the parameters are not changing, and then
+// hands the buffer off to a background thread. That thread writes it to a
+// temporary file and renames it over the checkpoint once the write is
+// complete, so an interrupted write never corrupts the previous checkpoint.
+// The directory is synced after the rename, so that the new checkpoint is
+// the one found after a crash.
+class AsyncCheckpointer {
+public:
+  explicit AsyncCheckpointer(const string& filename);
+  ~AsyncCheckpointer();
+
+  void Save(Dict& vocab, const DependencyOutputModel& model, Model& dynet_model, const Trainer* const trainer);
+  // Blocks until any outstanding write has finished
+  void Wait();
+
+private:
+  string filename;
+  thread writer;
+};
@@ -1,63 +1,147 @@
 #pragma once
 #include <deque>
+#include <vector>
+#include <algorithm>
 #include <utility>
 #include <memory>
+#include <cassert>
+#if defined(__AVX__) || defined(__SSE__)
+#include <immintrin.h>
+#endif
 #include "dynet/dict.h"
 #include "utils.h"
 
 using namespace dynet;
 using namespace std;
 
+// Keeps the max_size best-scoring items added to it. max_size must be at
+// least 1; a default-constructed list is only a placeholder to assign to.
+// Items are kept in a binary min-heap keyed on (score, insertion order), so
+// adding an item costs O(log max_size). hypothesis_list() returns the items
+// from best to worst. Among items with equal scores, the most recently
+// added one comes first, and is the one kept when the list is full.
 template <typename T>
 class KBestList {
 public:
   unsigned max_size;
 
-  KBestList() : max_size(0) {}
-  explicit KBestList(unsigned max_size) : max_size(max_size) {}
+  KBestList() : max_size(0), sequence(0), sorted(true) {}
+  explicit KBestList(unsigned max_size) : max_size(max_size), sequence(0), sorted(true) {
+    assert (max_size > 0);
+  }
 
   bool add(double score, T hyp) {
-    if (size() == 0) {
-      hypotheses.push_back(make_pair(score, hyp));
-      return true;
-    }
-
-    // Check if this item is worse than EVERYTHING currently in the k-best list
-    if (score < hypotheses.back().first) {
-      if (size() == max_size) {
+    assert (max_size > 0);
+    if (size() >= max_size) {
+      // A new item beats the worst one unless its score is strictly lower
+      if (score < worst_score()) {
         return false;
       }
-      else {
-        hypotheses.push_back(make_pair(score, hyp));
-        return true;
-      }
+      pop_heap(heap.begin(), heap.end(), Better);
+      heap.pop_back();
     }
 
-    // Now we know that there exists atleast one item in the list worse than the new item
-    // So we traverse the list from the end, and find the correct position to insert the
-    // new item into.
-    auto it = hypotheses.begin();
-    for (; it != hypotheses.end() && it->first > score; ++it) {}
-    hypotheses.insert(it, make_pair(score, hyp));
-    if (size() > max_size) {
-      hypotheses.pop_back();
-    }
+    heap.push_back(Entry(score, sequence++, hyp));
+    push_heap(heap.begin(), heap.end(), Better);
+    sorted = false;
     return true;
   }
 
   double worst_score() const {
-    assert (hypotheses.size() > 0);
-    return hypotheses.back().first;
+    assert (heap.size() > 0);
+    return heap.front().score;
   }
 
-
   unsigned size() const {
-    return hypotheses.size();
+    return heap.size();
   }
 
   const deque<pair<double, T> >& hypothesis_list() const {
+    if (!sorted) {
+      vector<const Entry*> entries(heap.size());
+      for (unsigned i = 0; i < heap.size(); ++i) {
+        entries[i] = &heap[i];
+      }
+      sort(entries.begin(), entries.end(), [](const Entry* a, const Entry* b) { return Better(*a, *b); });
+
+      hypotheses.clear();
+      for (const Entry* entry : entries) {
+        hypotheses.push_back(make_pair(entry->score, entry->hyp));
+      }
+      sorted = true;
+    }
     return hypotheses;
   }
+
 private:
-  deque<pair<double, T>> hypotheses;
+  struct Entry {
+    Entry(double score, unsigned long sequence, const T& hyp) : score(score), sequence(sequence), hyp(hyp) {}
+    double score;
+    unsigned long sequence;
+    T hyp;
+  };
+
+  // The heap comparator, which puts the worst item at the front
+  static bool Better(const Entry& a, const Entry& b) {
+    return a.score > b.score || (a.score == b.score && a.sequence > b.sequence);
+  }
+
+  vector<Entry> heap;
+  unsigned long sequence;
+
+  // Sorted copy of the heap, rebuilt when needed by hypothesis_list()
+  mutable deque<pair<double, T>> hypotheses;
+  mutable bool sorted;
 };
+
+// Selects the K best of n scores, skipping the indices in excluded.
+// The result is the same as adding each non-excluded index to a
+// KBestList<unsigned> in increasing order, but once the list is full, whole
+// blocks of scores below its worst score are discarded with SIMD compares
+// without being looked at one by one.
+inline KBestList<unsigned> TopK(const float* scores, unsigned n, unsigned K, const vector<unsigned>& excluded) {
+  KBestList<unsigned> kbest(K);
+  auto consider = [&](unsigned i) {
+    if (find(excluded.begin(), excluded.end(), i) == excluded.end()) {
+      kbest.add(scores[i], i);
+    }
+  };
+
+  unsigned i = 0;
+  for (; i < n && kbest.size() < K; ++i) {
+    consider(i);
+  }
+  if (kbest.size() < K) {
+    return kbest;
+  }
+
+  // Later items win ties, so anything at least as good as the threshold
+  // has to be considered
+  float threshold = kbest.worst_score();
+#if defined(__AVX__)
+  for (; i + 8 <= n; i += 8) {
+    __m256 block = _mm256_loadu_ps(scores + i);
+    int mask = _mm256_movemask_ps(_mm256_cmp_ps(block, _mm256_set1_ps(threshold), _CMP_GE_OQ));
+    for (; mask != 0; mask &= mask - 1) {
+      consider(i + __builtin_ctz(mask));
+      threshold = kbest.worst_score();
+    }
+  }
+#elif defined(__SSE__)
+  for (; i + 4 <= n; i += 4) {
+    __m128 block = _mm_loadu_ps(scores + i);
+    int mask = _mm_movemask_ps(_mm_cmpge_ps(block, _mm_set1_ps(threshold)));
+    for (; mask != 0; mask &= mask - 1) {
+      consider(i + __builtin_ctz(mask));
+      threshold = kbest.worst_score();
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    if (scores[i] >= threshold) {
+      consider(i);
+      threshold = kbest.worst_score();
+    }
+  }
+  return kbest;
+}
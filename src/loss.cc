@@ -1,7 +1,12 @@
 #include <iostream>
+#include <fstream>
 #include <csignal>
+#include <atomic>
+#include <map>
+#include <thread>
 #include "train.h"
 #include "deplm.h"
+#include "native.h"
 #include "utils.h"
 #include "io.h"
 
@@ -11,6 +16,231 @@ using namespace dynet::mp;
 using namespace std;
 namespace po = boost::program_options;
 
+// Writes the native engine's scores for sentence i to out, in the same
+// format as the dynet code path below
+void ScoreNative(NativeDecoder& decoder, const SentenceView& sentence, unsigned i, const Dict& vocab, bool verbose, ostream& out) {
+  if (!verbose) {
+    out << i << " ||| " << decoder.SentenceLoss(sentence) << endl;
+    return;
+  }
+
+  out << fixed;
+  out.precision(4);
+  decoder.Reset();
+  unsigned p = 0;
+  for (unsigned j = 0; j < sentence.size(); ++j) {
+    const WordId word = sentence[j];
+    const string word_str = vocab.convert(word);
+    float loss = decoder.Loss(p, word);
+    KBestList<WordId> alternatives = decoder.PredictKBest(p, 3);
+    out << i << "\t" << j << "\t" << word_str << (word_str.length() < 8 ? "\t" : "") << "\t" << loss << "\t";
+    for (auto& kv : alternatives.hypothesis_list()) {
+      out << vocab.convert(get<1>(kv)) << " (" << get<0>(kv) << ") ";
+    }
+    out << endl;
+
+    p = decoder.AddInput(word, p);
+  }
+  out << endl;
+}
+
+// Scores text on thread_count threads, each with a decoder of its own over
+// the shared, read-only native_model. Sentences are handed out one at a
+// time from blocks of the text, and each block's output is written, in
+// input order, once all of its sentences are done.
+void ScoreNativeParallel(const NativeModel& native_model, const Corpus& text, const Dict& vocab, bool verbose, unsigned thread_count) {
+  vector<unique_ptr<NativeDecoder>> decoders;
+  for (unsigned t = 0; t < thread_count; ++t) {
+    decoders.emplace_back(new NativeDecoder(native_model));
+  }
+
+  const unsigned block_size = 256 * thread_count;
+  vector<string> outputs(block_size);
+  for (unsigned start = 0; start < text.size(); start += block_size) {
+    const unsigned end = min(text.size(), start + block_size);
+    atomic<unsigned> next(start);
+    vector<thread> workers;
+    for (unsigned t = 0; t < thread_count; ++t) {
+      workers.push_back(thread([&, t]() {
+        ostringstream out;
+        for (unsigned i = next++; i < end; i = next++) {
+          out.str("");
+          ScoreNative(*decoders[t], text[i], i, vocab, verbose, out);
+          outputs[i - start] = out.str();
+        }
+      }));
+    }
+    for (thread& worker : workers) {
+      worker.join();
+    }
+
+    for (unsigned i = start; i < end; ++i) {
+      cout << outputs[i - start];
+    }
+    cout.flush();
+  }
+}
+
+// One candidate of an n-best list in bin/predict's "id ||| sentence ||| score"
+// format. Anything after the sentence is ignored.
+struct NBestEntry {
+  string id;
+  string text;
+  vector<WordId> words;
+};
+
+// Reads an n-best list, grouping consecutive entries with the same id
+vector<vector<NBestEntry>> ReadNBestList(const string& filename, Dict& vocab) {
+  ifstream f(filename);
+  if (!f.is_open()) {
+    cerr << "Unable to open " << filename << " for reading." << endl;
+    exit(1);
+  }
+
+  const string separator = " ||| ";
+  vector<vector<NBestEntry>> groups;
+  unsigned line_number = 0;
+  for (string line; getline(f, line);) {
+    ++line_number;
+    const size_t id_end = line.find(separator);
+    if (id_end == string::npos) {
+      cerr << "Line " << line_number << " of " << filename << " is not an n-best list entry." << endl;
+      exit(1);
+    }
+    const size_t text_start = id_end + separator.size();
+    const size_t text_end = line.find(separator, text_start);
+
+    NBestEntry entry;
+    entry.id = line.substr(0, id_end);
+    entry.text = line.substr(text_start, (text_end == string::npos) ? string::npos : text_end - text_start);
+    entry.words = read_sentence(entry.text, vocab);
+    if (groups.size() == 0 || groups.back().back().id != entry.id) {
+      groups.push_back(vector<NBestEntry>());
+    }
+    groups.back().push_back(entry);
+  }
+  return groups;
+}
+
+// A group of candidates merged into a trie of their prefixes. Node 0 is the
+// empty prefix, and every other node is its parent's prefix plus one word.
+// Parents always come before their children.
+struct PrefixTrie {
+  explicit PrefixTrie(const vector<NBestEntry>& candidates) : parent(1, 0), word(1, -1), depth(1, 0), has_children(1, false) {
+    map<pair<unsigned, WordId>, unsigned> children;
+    for (const NBestEntry& candidate : candidates) {
+      unsigned node = 0;
+      for (WordId w : candidate.words) {
+        auto it = children.find(make_pair(node, w));
+        if (it == children.end()) {
+          it = children.insert(make_pair(make_pair(node, w), (unsigned)parent.size())).first;
+          parent.push_back(node);
+          word.push_back(w);
+          depth.push_back(depth[node] + 1);
+          has_children.push_back(false);
+          has_children[node] = true;
+        }
+        node = it->second;
+      }
+      ends.push_back(node);
+    }
+  }
+
+  unsigned size() const {
+    return parent.size();
+  }
+
+  // The total loss of each candidate, given the loss of each node's word
+  // after its parent's prefix. Sums in the same order as scoring each
+  // candidate on its own would.
+  vector<float> CandidateLosses(const vector<float>& node_losses) const {
+    vector<float> prefix_losses(size(), 0.0f);
+    for (unsigned i = 1; i < size(); ++i) {
+      prefix_losses[i] = prefix_losses[parent[i]] + node_losses[i];
+    }
+    vector<float> losses(ends.size());
+    for (unsigned k = 0; k < ends.size(); ++k) {
+      losses[k] = prefix_losses[ends[k]];
+    }
+    return losses;
+  }
+
+  vector<unsigned> parent;
+  vector<WordId> word;
+  vector<unsigned> depth;
+  vector<bool> has_children;
+  vector<unsigned> ends; // The node each candidate ends at
+};
+
+// Scores the word of each trie node after its parent's prefix, in one
+// graph. Each distinct prefix is fed to the LSTMs once, and each state's
+// output layer is built once, however many candidates share them.
+vector<float> ScoreTrie(DependencyOutputModel& model, const PrefixTrie& trie) {
+  vector<RNNPointer> states(trie.size());
+  states[0] = model.GetStatePointer();
+  vector<Expression> losses;
+  for (unsigned i = 1; i < trie.size(); ++i) {
+    const RNNPointer p = states[trie.parent[i]];
+    losses.push_back(model.Loss(p, trie.word[i]));
+    if (trie.has_children[i]) {
+      model.AddInput(trie.word[i], p);
+      states[i] = model.GetStatePointer();
+    }
+  }
+
+  vector<float> node_losses(trie.size(), 0.0f);
+  if (losses.size() > 0) {
+    vector<float> values = as_vector(concatenate(losses).value());
+    copy(values.begin(), values.end(), node_losses.begin() + 1);
+  }
+  return node_losses;
+}
+
+// The same on the native engine. The trie is walked one depth at a time, so
+// that all prefixes of the same length are scored and extended as a batch.
+vector<float> ScoreTrie(NativeDecoder& decoder, const PrefixTrie& trie) {
+  vector<vector<unsigned>> levels;
+  for (unsigned i = 1; i < trie.size(); ++i) {
+    if (trie.depth[i] > levels.size()) {
+      levels.resize(trie.depth[i]);
+    }
+    levels[trie.depth[i] - 1].push_back(i);
+  }
+
+  decoder.Reset();
+  vector<unsigned> states(trie.size(), 0);
+  vector<float> node_losses(trie.size(), 0.0f);
+  for (const vector<unsigned>& level : levels) {
+    vector<unsigned> ps;
+    vector<WordId> level_words;
+    for (unsigned i : level) {
+      ps.push_back(states[trie.parent[i]]);
+      level_words.push_back(trie.word[i]);
+    }
+    vector<float> level_losses = decoder.Losses(ps, level_words);
+
+    vector<unsigned> extended;
+    vector<WordId> words;
+    vector<unsigned> from;
+    for (unsigned k = 0; k < level.size(); ++k) {
+      const unsigned i = level[k];
+      node_losses[i] = level_losses[k];
+      if (trie.has_children[i]) {
+        extended.push_back(i);
+        words.push_back(trie.word[i]);
+        from.push_back(ps[k]);
+      }
+    }
+    if (extended.size() > 0) {
+      vector<unsigned> next = decoder.AddInputs(words, from);
+      for (unsigned k = 0; k < extended.size(); ++k) {
+        states[extended[k]] = next[k];
+      }
+    }
+  }
+  return node_losses;
+}
+
 int main(int argc, char** argv) {
   dynet::initialize(argc, argv, true);
 
@@ -19,6 +249,12 @@ int main(int argc, char** argv) {
   ("help", "Display this help message")
   ("model", po::value<string>()->required(), "Trained model whose grammar will be dumped")
   ("verbose", "Verbose word-level output")
+  ("native", "Score with the native inference engine instead of building dynet graphs")
+  ("check_native", po::value<float>(), "Score with both dynet and the native engine, and warn about any sentence whose losses differ by more than this")
+  ("quantize", "Run the native inference engine with int8 weights. Implies --native unless --check_native is given")
+  ("threads", po::value<unsigned>()->default_value(1), "Score sentences on this many threads. More than one implies --native")
+  ("nbest", "Read the text as an n-best list in bin/predict's \"id ||| sentence ||| score\" format, and score each candidate once per distinct prefix it shares with the other candidates for its id")
+  ("input_cache", po::value<string>(), "Keep the precomputed input of every word in this file, and reuse it on later runs")
   ("text", po::value<string>()->required(), "Input text");
 
   AddTrainerOptions(desc);
@@ -37,19 +273,83 @@ int main(int argc, char** argv) {
 
   po::notify(vm);
 
+  if (vm["threads"].as<unsigned>() == 0) {
+    cerr << "Invalid parameters: --threads must be at least 1." << endl;
+    return 1;
+  }
+  if (vm["threads"].as<unsigned>() > 1 && vm.count("check_native")) {
+    cerr << "Invalid parameters: --check_native cannot be combined with --threads, since dynet runs on a single thread." << endl;
+    return 1;
+  }
+  if (vm.count("check_native") && (vm.count("verbose") || vm.count("native"))) {
+    cerr << "Invalid parameters: --check_native cannot be combined with --verbose or --native, since it needs to score every sentence with dynet too." << endl;
+    return 1;
+  }
+  if (vm.count("nbest") && (vm.count("verbose") || vm.count("check_native") || vm["threads"].as<unsigned>() > 1)) {
+    cerr << "Invalid parameters: --nbest cannot be combined with --verbose, --check_native or --threads." << endl;
+    return 1;
+  }
+
   Dict vocab;
   Model dynet_model;
   DependencyOutputModel* model = new DependencyOutputModel();
   Trainer* trainer = nullptr;
 
   const bool verbose = vm.count("verbose") > 0;
+  const bool check_native = vm.count("check_native") > 0;
+  const bool quantize = vm.count("quantize") > 0;
+  const unsigned thread_count = vm["threads"].as<unsigned>();
+  const bool native = vm.count("native") > 0 || (quantize && !check_native) || thread_count > 1;
   const string model_filename = vm["model"].as<string>();
   const string text_filename = vm["text"].as<string>();
   Deserialize(model_filename, vocab, *model, dynet_model, trainer);
+  model->PrecomputeInputs(vm.count("input_cache") ? vm["input_cache"].as<string>() : "");
+
+  unique_ptr<NativeModel> native_model;
+  unique_ptr<NativeDecoder> decoder;
+  if (native || check_native) {
+    native_model.reset(new NativeModel(*model));
+    if (quantize) {
+      native_model->Quantize();
+    }
+    decoder.reset(new NativeDecoder(*native_model));
+  }
 
-  vector<OutputSentence> input_text = ReadText(text_filename, vocab);
+  if (vm.count("nbest")) {
+    for (const vector<NBestEntry>& candidates : ReadNBestList(text_filename, vocab)) {
+      PrefixTrie trie(candidates);
+      vector<float> node_losses;
+      if (native) {
+        node_losses = ScoreTrie(*decoder, trie);
+      }
+      else {
+        ComputationGraph cg;
+        model->NewGraph(cg);
+        node_losses = ScoreTrie(*model, trie);
+      }
+
+      vector<float> losses = trie.CandidateLosses(node_losses);
+      for (unsigned k = 0; k < candidates.size(); ++k) {
+        cout << candidates[k].id << " ||| " << candidates[k].text << " ||| " << losses[k] << endl;
+      }
+    }
+    return 0;
+  }
 
+  Corpus input_text = ReadCorpus(text_filename, vocab);
+
+  if (native && thread_count > 1) {
+    ScoreNativeParallel(*native_model, input_text, vocab, verbose, thread_count);
+    return 0;
+  }
+
+  unsigned mismatches = 0;
   for (unsigned i = 0; i < input_text.size(); ++i) {
+    if (native) {
+      ScoreNative(*decoder, input_text[i], i, vocab, verbose, cout);
+      continue;
+    }
+
     ComputationGraph cg;
     model->NewGraph(cg);
     if (verbose) {
@@ -57,8 +357,8 @@ int main(int argc, char** argv) {
       cout << fixed;
       cout.precision(4);
       for (unsigned j = 0; j < input_text[i].size(); ++j) {
-        const shared_ptr<const Word> word = input_text[i][j];
-        const string word_str = vocab.convert(dynamic_pointer_cast<const StandardWord>(word)->id);
+        const WordId word = input_text[i][j];
+        const string word_str = vocab.convert(word);
         RNNPointer p = model->GetStatePointer();
         float loss = as_scalar(model->Loss(p, word).value());
         KBestList<shared_ptr<Word>> alternatives = model->PredictKBest(p, 3);
@@ -78,8 +378,21 @@ int main(int argc, char** argv) {
       Expression loss_expr = model->BuildGraph(input_text[i]);
       float loss = as_scalar(loss_expr.value());
       cout << i << " ||| " << loss << endl;
+
+      if (check_native) {
+        float native_loss = decoder->SentenceLoss(input_text[i]);
+        if (fabs(native_loss - loss) > vm["check_native"].as<float>()) {
+          cerr << "Sentence " << i << ": dynet loss " << loss << " but native loss " << native_loss << endl;
+          mismatches++;
+        }
+      }
     }
   }
 
+  if (check_native) {
+    cerr << mismatches << " of " << input_text.size() << " sentences differ between dynet and the native engine." << endl;
+    return (mismatches == 0) ? 0 : 1;
+  }
+
   return 0;
 }
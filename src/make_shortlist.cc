@@ -0,0 +1,114 @@
+#include <iostream>
+#include <cmath>
+#include <boost/program_options.hpp>
+#include "deplm.h"
+#include "native.h"
+#include "shortlist.h"
+#include "utils.h"
+#include "io.h"
+
+using namespace dynet;
+using namespace std;
+namespace po = boost::program_options;
+
+// Builds a vocabulary shortlist from a training text, for use with
+// predict --shortlist and sample --shortlist. Given a dev text, also reports
+// how much of the model's probability mass falls outside the shortlist.
+int main(int argc, char** argv) {
+  dynet::initialize(argc, argv, true);
+
+  po::options_description desc("description");
+  desc.add_options()
+  ("help", "Display this help message")
+  ("model", po::value<string>()->required(), "Trained model")
+  ("text", po::value<string>()->required(), "Text to count word frequencies in, normally the training text")
+  ("output", po::value<string>(), "Write the shortlist to this file")
+  ("size,n", po::value<unsigned>()->default_value(10000), "Number of most frequent words to include")
+  ("followers", po::value<unsigned>()->default_value(0), "Also include, after each word, this many of the words that most often follow it")
+  ("dev_text", po::value<string>(), "Report the probability mass that the shortlist misses on this text");
+
+  po::positional_options_description positional_options;
+  positional_options.add("model", 1);
+  positional_options.add("text", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(positional_options).run(), vm);
+
+  if (vm.count("help")) {
+    cerr << desc;
+    return 1;
+  }
+
+  po::notify(vm);
+
+  if (!vm.count("output") && !vm.count("dev_text")) {
+    cerr << "Invalid parameters: Please specify --output, --dev_text or both." << endl;
+    return 1;
+  }
+
+  Dict vocab;
+  Model dynet_model;
+  DependencyOutputModel* model = new DependencyOutputModel();
+  Trainer* trainer = nullptr;
+  Deserialize(vm["model"].as<string>(), vocab, *model, dynet_model, trainer);
+
+  Corpus text = ReadCorpus(vm["text"].as<string>(), vocab);
+  vector<unsigned> always = {(unsigned)vocab.convert("</LEFT>"), (unsigned)vocab.convert("</RIGHT>")};
+  // The shortlist covers the model's own vocabulary, which may lack the UNK
+  // that the Dict gained after the model was built
+  vector<unsigned> word_counts = CountWords(text, vocab.size());
+  word_counts.resize(model->VocabSize());
+  Shortlist shortlist(word_counts, vm["size"].as<unsigned>(), always);
+  const unsigned follower_count = vm["followers"].as<unsigned>();
+  if (follower_count > 0) {
+    shortlist.AddFollowers(text, follower_count);
+  }
+  cerr << "Shortlist has " << shortlist.CommonWordCount() << " common words, plus up to " << follower_count << " followers of each word." << endl;
+
+  if (vm.count("output")) {
+    SaveShortlist(vm["output"].as<string>(), shortlist);
+  }
+
+  if (vm.count("dev_text")) {
+    Corpus dev_text = ReadCorpus(vm["dev_text"].as<string>(), vocab);
+    NativeModel native_model(*model);
+    NativeDecoder decoder(native_model);
+
+    double total_missed = 0.0;
+    double max_missed = 0.0;
+    double total_size = 0.0;
+    size_t uncovered = 0;
+    vector<unsigned> words;
+    for (unsigned i = 0; i < dev_text.size(); ++i) {
+      decoder.Reset();
+      unsigned p = 0;
+      WordId prev_word = -1;
+      for (WordId word : dev_text[i]) {
+        const NativeVector& log_probs = decoder.LogProbabilities(p);
+        shortlist.Words(prev_word, words);
+        double covered = 0.0;
+        for (unsigned w : words) {
+          covered += exp(log_probs(w));
+        }
+        const double missed = max(0.0, 1.0 - covered);
+        total_missed += missed;
+        max_missed = max(max_missed, missed);
+        total_size += words.size();
+        if (!shortlist.Contains(prev_word, word)) {
+          uncovered++;
+        }
+
+        p = decoder.AddInput(word, p);
+        prev_word = word;
+      }
+    }
+
+    const double word_count = dev_text.word_count();
+    cerr << "Average shortlist size: " << total_size / word_count << " of " << vocab.size() << " words" << endl;
+    cerr << "Missed probability mass: " << total_missed / word_count << " on average, " << max_missed << " at most" << endl;
+    cerr << "Dev words outside the shortlist: " << uncovered << " of " << dev_text.word_count()
+         << " (" << 100.0 * uncovered / word_count << "%)" << endl;
+  }
+
+  return 0;
+}
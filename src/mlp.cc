@@ -1,30 +1,85 @@
 #include "mlp.h"
 
-MLP::MLP() {}
+MLP::MLP() : tied(false), has_projection(false) {}
 
-MLP::MLP(Model& model, unsigned input_size, unsigned hidden_size, unsigned output_size) {
+MLP::MLP(Model& model, unsigned input_size, unsigned hidden_size, unsigned output_size) : tied(false), has_projection(false) {
   p_wIH = model.add_parameters({hidden_size, input_size});
   p_wHb = model.add_parameters({hidden_size});
   p_wHO = model.add_parameters({output_size, hidden_size});
   p_wOb = model.add_parameters({output_size});
 }
 
+MLP::MLP(Model& model, unsigned input_size, unsigned hidden_size, LookupParameter output_embeddings) : tied(true) {
+  const unsigned output_size = output_embeddings.get()->values.size();
+  const unsigned emb_dim = output_embeddings.get()->dim[0];
+  has_projection = (emb_dim != hidden_size);
+
+  p_wIH = model.add_parameters({hidden_size, input_size});
+  p_wHb = model.add_parameters({hidden_size});
+  p_embeddings = output_embeddings;
+  if (has_projection) {
+    p_wHP = model.add_parameters({emb_dim, hidden_size});
+  }
+  p_wOb = model.add_parameters({output_size});
+}
+
 void MLP::NewGraph(ComputationGraph& cg) {
   wIH = parameter(cg, p_wIH);
   wHb = parameter(cg, p_wHb);
-  wHO = parameter(cg, p_wHO);
   wOb = parameter(cg, p_wOb);
+  if (tied) {
+    embeddings = parameter(cg, p_embeddings);
+    if (has_projection) {
+      wHP = parameter(cg, p_wHP);
+    }
+  }
+  else {
+    wHO = parameter(cg, p_wHO);
+  }
 }
 
 void MLP::SetDropout(float rate) {
   dropout_rate = rate;
 }
 
+unsigned MLP::HiddenDim() const {
+  return p_wHb.get()->dim[0];
+}
+
+unsigned MLP::OutputDim() const {
+  return p_wOb.get()->dim[0];
+}
+
 Expression MLP::Feed(Expression input) const {
+  return Output(Hidden(input));
+}
+
+Expression MLP::Hidden(Expression input) const {
   Expression h = tanh(affine_transform({wHb, wIH, input}));
   if (dropout_rate != 0.0f) {
     h = dropout(h, dropout_rate);
   }
-  Expression o = affine_transform({wOb, wHO, h});
+  return h;
+}
+
+Expression MLP::Project(Expression hidden) const {
+  return has_projection ? wHP * hidden : hidden;
+}
+
+// With tied embeddings the scores are computed as (h^T E)^T rather than
+// E^T h, so that only vectors ever get transposed, never the whole table
+Expression MLP::Output(Expression hidden) const {
+  if (tied) {
+    return transpose(transpose(Project(hidden)) * embeddings) + wOb;
+  }
+  Expression o = affine_transform({wOb, wHO, hidden});
+  return o;
+}
+
+Expression MLP::Output(Expression hidden, const vector<unsigned>& rows) const {
+  if (tied) {
+    return transpose(transpose(Project(hidden)) * select_cols(embeddings, rows)) + select_rows(wOb, rows);
+  }
+  Expression o = affine_transform({select_rows(wOb, rows), select_rows(wHO, rows), hidden});
   return o;
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include <boost/serialization/access.hpp>
+#include <boost/serialization/version.hpp>
 #include "dynet/dynet.h"
 #include "dynet/expr.h"
 
@@ -11,29 +12,64 @@ class MLP {
 public:
   MLP();
   MLP(Model& model, unsigned input_size, unsigned hidden_size, unsigned output_size);
+  // An MLP whose output layer reuses a table of embeddings, one per output,
+  // in place of a weight matrix of its own. If the embeddings are not of
+  // size hidden_size, the hidden layer is projected to their size first.
+  MLP(Model& model, unsigned input_size, unsigned hidden_size, LookupParameter output_embeddings);
   void NewGraph(ComputationGraph& cg);
   void SetDropout(float rate);
+  unsigned HiddenDim() const;
+  unsigned OutputDim() const;
   Expression Feed(Expression input) const;
 
+  // The two halves of Feed(). Output() computes only the given rows of the
+  // output layer, in the order given.
+  Expression Hidden(Expression input) const;
+  Expression Output(Expression hidden) const;
+  Expression Output(Expression hidden, const vector<unsigned>& rows) const;
+
 private:
+  // With tied embeddings, the hidden layer as the output layer sees it
+  Expression Project(Expression hidden) const;
+
   float dropout_rate;
+  bool tied;
+  bool has_projection;
 
   Parameter p_wIH;
-  Parameter p_wHO;
+  Parameter p_wHO; // Unused if tied
   Parameter p_wHb;
   Parameter p_wOb;
+  LookupParameter p_embeddings; // Only if tied
+  Parameter p_wHP; // Only if tied and has_projection
 
   Expression wIH;
   Expression wHO;
   Expression wHb;
   Expression wOb;
+  Expression embeddings; // The whole table, one column per output
+  Expression wHP;
 
+  friend class NativeModel;
   friend class boost::serialization::access;
   template<class Archive>
-  void serialize(Archive& ar, const unsigned int) {
+  void serialize(Archive& ar, const unsigned int version) {
+    if (version >= 1) {
+      ar & tied;
+      ar & has_projection;
+    }
     ar & p_wIH;
-    ar & p_wHO;
+    if (tied) {
+      ar & p_embeddings;
+      if (has_projection) {
+        ar & p_wHP;
+      }
+    }
+    else {
+      ar & p_wHO;
+    }
     ar & p_wHb;
     ar & p_wOb;
   }
 };
+BOOST_CLASS_VERSION(MLP, 1)
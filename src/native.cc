@@ -0,0 +1,733 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include "native.h"
+
+// Copies a parameter's values out of dynet. dynet stores matrices in column
+// major order, just like NativeMatrix.
+NativeMatrix ToNative(const Parameter& p) {
+  const Tensor& t = p.get()->values;
+  return Eigen::Map<const NativeMatrix>(t.v, t.d.rows(), t.d.cols());
+}
+
+float LogSumExp(const NativeVector& v) {
+  const float m = v.maxCoeff();
+  return m + log((v.array() - m).exp().sum());
+}
+
+// Replaces v with log_softmax(v)
+void LogSoftmax(NativeVector& v) {
+  v.array() -= LogSumExp(v);
+}
+
+NativeWeights::NativeWeights() : quantized(false) {}
+
+NativeWeights::NativeWeights(const NativeMatrix& m) : quantized(false), floats(m) {}
+
+void NativeWeights::Quantize() {
+  if (!quantized) {
+    quantized_values = QuantizedMatrix(floats);
+    floats.resize(0, 0);
+    quantized = true;
+  }
+}
+
+unsigned NativeWeights::rows() const {
+  return quantized ? quantized_values.rows() : floats.rows();
+}
+
+unsigned NativeWeights::cols() const {
+  return quantized ? quantized_values.cols() : floats.cols();
+}
+
+size_t NativeWeights::Bytes() const {
+  return quantized ? quantized_values.Bytes() : floats.size() * sizeof(float);
+}
+
+void NativeWeights::MultiplyAdd(const Eigen::Ref<const NativeMatrix>& x, Eigen::Ref<NativeMatrix> out) const {
+  if (quantized) {
+    quantized_values.MultiplyAdd(x, out);
+  }
+  else {
+    out.noalias() += floats * x;
+  }
+}
+
+void NativeWeights::MultiplyRows(const vector<unsigned>& rows, const Eigen::Ref<const NativeMatrix>& x, Eigen::Ref<NativeMatrix> out) const {
+  if (quantized) {
+    quantized_values.MultiplyRows(rows, x, out);
+    return;
+  }
+  for (unsigned k = 0; k < rows.size(); ++k) {
+    out.row(k).noalias() = floats.row(rows[k]) * x;
+  }
+}
+
+NativeLSTM::NativeLSTM() : hidden_dim(0) {}
+
+NativeLSTM::NativeLSTM(const LSTMBuilder& lstm, const NativeVector& initial_cells) {
+  const unsigned layer_count = lstm.params.size();
+  for (unsigned i = 0; i < layer_count; ++i) {
+    const vector<Parameter>& p = lstm.params[i];
+    NativeMatrix x2i = ToNative(p[X2I]), x2c = ToNative(p[X2C]), x2o = ToNative(p[X2O]);
+    NativeMatrix h2i = ToNative(p[H2I]), h2c = ToNative(p[H2C]), h2o = ToNative(p[H2O]);
+    NativeVector bi = ToNative(p[BI]), bc = ToNative(p[BC]), bo = ToNative(p[BO]);
+    hidden_dim = x2i.rows();
+
+    Layer layer;
+    NativeMatrix x2g(3 * hidden_dim, x2i.cols());
+    x2g << x2i, x2c, x2o;
+    layer.x2g = x2g;
+    NativeMatrix h2g(3 * hidden_dim, hidden_dim);
+    h2g << h2i, h2c, h2o;
+    layer.h2g = h2g;
+    layer.bg.resize(3 * hidden_dim);
+    layer.bg << bi, bc, bo;
+    layer.c2i = ToNative(p[C2I]);
+    layer.c2o = ToNative(p[C2O]);
+    layers.push_back(layer);
+  }
+
+  // Same as MakeLSTMInitialState: the cells come from the start of the
+  // initial state parameter, and each hidden vector is tanh of its cell
+  const unsigned n = layer_count * hidden_dim;
+  initial_state.resize(2 * n);
+  initial_state.head(n) = initial_cells.head(n);
+  initial_state.tail(n) = initial_cells.head(n).array().tanh();
+}
+
+void NativeLSTM::Step(const NativeMatrix& prev, const NativeMatrix& x, NativeMatrix& next, NativeMatrix& gates) const {
+  const unsigned d = hidden_dim;
+  const unsigned n = layers.size() * d;
+  const unsigned batch_size = x.cols();
+  next.resize(2 * n, batch_size);
+  gates.resize(3 * d, batch_size);
+
+  for (unsigned i = 0; i < layers.size(); ++i) {
+    const Layer& layer = layers[i];
+    auto c_prev = prev.middleRows(i * d, d);
+    auto h_prev = prev.middleRows(n + i * d, d);
+    auto c = next.middleRows(i * d, d);
+    auto h = next.middleRows(n + i * d, d);
+
+    gates = layer.bg.replicate(1, batch_size);
+    if (i == 0) {
+      layer.x2g.MultiplyAdd(x, gates);
+    }
+    else {
+      layer.x2g.MultiplyAdd(next.middleRows(n + (i - 1) * d, d), gates);
+    }
+    layer.h2g.MultiplyAdd(h_prev, gates);
+
+    auto input_gate = gates.middleRows(0, d);
+    auto cell_input = gates.middleRows(d, d);
+    auto output_gate = gates.middleRows(2 * d, d);
+
+    layer.c2i.MultiplyAdd(c_prev, input_gate);
+    input_gate = (1.0f + (-input_gate.array()).exp()).inverse();
+    cell_input = cell_input.array().tanh();
+    // The forget gate is 1 - input_gate
+    c = c_prev.array() + input_gate.array() * (cell_input.array() - c_prev.array());
+
+    layer.c2o.MultiplyAdd(c, output_gate);
+    output_gate = (1.0f + (-output_gate.array()).exp()).inverse();
+    h = output_gate.array() * c.array().tanh();
+  }
+}
+
+Eigen::Map<const NativeVector> NativeLSTM::Output(const NativeVector& state) const {
+  return Eigen::Map<const NativeVector>(state.data() + state.size() - hidden_dim, hidden_dim);
+}
+
+void NativeLSTM::Quantize() {
+  for (Layer& layer : layers) {
+    layer.x2g.Quantize();
+    layer.h2g.Quantize();
+    layer.c2i.Quantize();
+    layer.c2o.Quantize();
+  }
+}
+
+size_t NativeLSTM::Bytes() const {
+  size_t bytes = 0;
+  for (const Layer& layer : layers) {
+    bytes += layer.x2g.Bytes() + layer.h2g.Bytes() + layer.c2i.Bytes() + layer.c2o.Bytes();
+  }
+  return bytes;
+}
+
+NativeModel::NativeModel(const DependencyOutputModel& model) {
+  stack_lstm = NativeLSTM(model.stack_lstm, ToNative(model.stack_lstm_init_p));
+  comp_lstm = NativeLSTM(model.comp_lstm, ToNative(model.comp_lstm_init_p));
+  assert (stack_lstm.hidden_dim == model.half_state_dim);
+
+  // Any embedder works once the model has precomputed its inputs, but only
+  // a StandardEmbedder's embeddings can be transformed here directly
+  if (model.HasPrecomputedInputs()) {
+    inputs.resize(model.half_state_dim, model.input_table.size());
+    for (unsigned i = 0; i < model.input_table.size(); ++i) {
+      inputs.col(i) = Eigen::Map<const NativeVector>(model.input_table[i].data(), model.half_state_dim);
+    }
+  }
+  else {
+    const StandardEmbedder* embedder = dynamic_cast<const StandardEmbedder*>(model.embedder);
+    if (embedder == nullptr) {
+      cerr << "The native inference engine only supports models with a StandardEmbedder, unless their inputs are precomputed." << endl;
+      exit(1);
+    }
+    const LookupParameterStorage* lookup = embedder->embeddings.get();
+    NativeMatrix embeddings(embedder->emb_dim, lookup->values.size());
+    for (unsigned i = 0; i < lookup->values.size(); ++i) {
+      embeddings.col(i) = Eigen::Map<const NativeVector>(lookup->values[i].v, embedder->emb_dim);
+    }
+    inputs.noalias() = ToNative(model.emb_transform_p) * embeddings;
+  }
+
+  const MLP& mlp = model.final_mlp;
+  wIH = ToNative(mlp.p_wIH);
+  wHb = ToNative(mlp.p_wHb);
+  wOb = ToNative(mlp.p_wOb);
+  has_output_projection = mlp.tied && mlp.has_projection;
+  if (mlp.tied) {
+    // The output matrix is the embedding table, one row per word
+    const LookupParameterStorage* table = mlp.p_embeddings.get();
+    NativeMatrix output_embeddings(table->values.size(), table->dim[0]);
+    for (unsigned i = 0; i < table->values.size(); ++i) {
+      output_embeddings.row(i) = Eigen::Map<const NativeVector>(table->values[i].v, table->dim[0]);
+    }
+    wHO = output_embeddings;
+    if (has_output_projection) {
+      wHP = ToNative(mlp.p_wHP);
+    }
+  }
+  else {
+    wHO = ToNative(mlp.p_wHO);
+  }
+
+  class_factored = (model.class_softmax != nullptr);
+  if (class_factored) {
+    wHC = ToNative(model.class_softmax->p_wHC);
+    wCb = ToNative(model.class_softmax->p_wCb);
+    word_class = model.class_softmax->word_class;
+    class_words = model.class_softmax->class_words;
+  }
+
+  done_with_left = model.done_with_left;
+  done_with_right = model.done_with_right;
+}
+
+unsigned NativeModel::VocabSize() const {
+  return wOb.size();
+}
+
+void NativeModel::Quantize() {
+  stack_lstm.Quantize();
+  comp_lstm.Quantize();
+  wIH.Quantize();
+  wHO.Quantize();
+  wHP.Quantize();
+}
+
+size_t NativeModel::QuantizableBytes() const {
+  return stack_lstm.Bytes() + comp_lstm.Bytes() + wIH.Bytes() + wHO.Bytes() + wHP.Bytes();
+}
+
+NativeDecoder::NativeDecoder(const NativeModel& model) : model(model), shortlist(nullptr), node_count(0) {
+  Reset();
+}
+
+void NativeDecoder::Reset() {
+  states.clear();
+  states.push_back({-1, -1, 0, true, -1, -1});
+  node_count = 0;
+  has_log_probs.assign(1, false);
+}
+
+void NativeDecoder::SetShortlist(const Shortlist* shortlist) {
+  if (shortlist != nullptr && model.class_factored) {
+    cerr << "Shortlists are not supported with a class-factored softmax." << endl;
+    exit(1);
+  }
+  if (shortlist != nullptr && shortlist->VocabSize() != model.VocabSize()) {
+    cerr << "The shortlist was built for a vocabulary of " << shortlist->VocabSize() << " words, but the model has " << model.VocabSize() << "." << endl;
+    exit(1);
+  }
+  this->shortlist = shortlist;
+  has_log_probs.assign(states.size(), false);
+}
+
+const NativeVector& NativeDecoder::Node(const NativeLSTM& lstm, int node) const {
+  return (node == -1) ? lstm.initial_state : nodes[node];
+}
+
+void NativeDecoder::Step(const NativeLSTM& lstm, const vector<int>& prev, const NativeMatrix& x, vector<int>& next) {
+  batch_prev.resize(lstm.initial_state.size(), prev.size());
+  for (unsigned j = 0; j < prev.size(); ++j) {
+    batch_prev.col(j) = Node(lstm, prev[j]);
+  }
+  lstm.Step(batch_prev, x, batch_next, gates);
+
+  next.resize(prev.size());
+  for (unsigned j = 0; j < prev.size(); ++j) {
+    if (node_count == nodes.size()) {
+      nodes.push_back(NativeVector());
+    }
+    nodes[node_count] = batch_next.col(j);
+    next[j] = node_count++;
+  }
+}
+
+unsigned NativeDecoder::AddInput(WordId word, unsigned p) {
+  return AddInputs(vector<WordId>(1, word), vector<unsigned>(1, p))[0];
+}
+
+// The same state machine as DependencyOutputModel::AddInput, run on a whole
+// batch of (word, state) pairs at once. Each LSTM is stepped at most twice,
+// with one column per pair that needs it:
+//  1. Ordinary words push onto the stack LSTM.
+//  2. Every word is added to the comp LSTM: ordinary words start a new
+//     composition, while </LEFT> and </RIGHT> continue the current one.
+//  3. For </RIGHT>, the finished composition is then added to the
+//     composition of the state being popped back to.
+vector<unsigned> NativeDecoder::AddInputs(const vector<WordId>& words, const vector<unsigned>& ps) {
+  assert (words.size() == ps.size());
+  const unsigned batch_size = words.size();
+
+  batch_inputs.resize(model.inputs.rows(), batch_size);
+  for (unsigned j = 0; j < batch_size; ++j) {
+    assert (ps[j] < states.size());
+    batch_inputs.col(j) = model.inputs.col(words[j]);
+  }
+
+  vector<unsigned> pushes;
+  vector<unsigned> pops;
+  vector<int> prev(batch_size);
+  for (unsigned j = 0; j < batch_size; ++j) {
+    const State& state = states[ps[j]];
+    if (words[j] == model.done_with_right) {
+      assert (state.left_done);
+      pops.push_back(j);
+      prev[j] = state.comp_node;
+    }
+    else if (words[j] == model.done_with_left) {
+      assert (!state.left_done);
+      prev[j] = state.comp_node;
+    }
+    else {
+      pushes.push_back(j);
+      prev[j] = -1;
+    }
+  }
+
+  vector<int> stack_nodes;
+  if (pushes.size() > 0) {
+    vector<int> stack_prev(pushes.size());
+    batch_x.resize(batch_inputs.rows(), pushes.size());
+    for (unsigned k = 0; k < pushes.size(); ++k) {
+      stack_prev[k] = states[ps[pushes[k]]].stack_node;
+      batch_x.col(k) = batch_inputs.col(pushes[k]);
+    }
+    Step(model.stack_lstm, stack_prev, batch_x, stack_nodes);
+  }
+
+  vector<int> comp_nodes;
+  Step(model.comp_lstm, prev, batch_inputs, comp_nodes);
+
+  vector<int> pop_nodes;
+  if (pops.size() > 0) {
+    vector<int> pop_prev(pops.size());
+    batch_x.resize(model.comp_lstm.hidden_dim, pops.size());
+    for (unsigned k = 0; k < pops.size(); ++k) {
+      int pop_to = states[ps[pops[k]]].pop_to;
+      pop_prev[k] = (pop_to == -1) ? -1 : states[pop_to].comp_node;
+      batch_x.col(k) = model.comp_lstm.Output(nodes[comp_nodes[pops[k]]]);
+    }
+    Step(model.comp_lstm, pop_prev, batch_x, pop_nodes);
+  }
+
+  vector<unsigned> r(batch_size);
+  unsigned next_push = 0;
+  unsigned next_pop = 0;
+  for (unsigned j = 0; j < batch_size; ++j) {
+    const unsigned p = ps[j];
+    State state = states[p];
+    if (words[j] == model.done_with_right) {
+      state.comp_node = pop_nodes[next_pop++];
+      if (state.pop_to == -1) {
+        state.stack_node = -1;
+        state.stack_depth--;
+        state.left_done = true;
+      }
+      else {
+        const State& pop_to = states[state.pop_to];
+        state.stack_node = pop_to.stack_node;
+        state.stack_depth--;
+        assert (state.stack_depth == pop_to.stack_depth);
+        state.left_done = pop_to.left_done;
+        state.pop_to = pop_to.pop_to;
+      }
+    }
+    else if (words[j] == model.done_with_left) {
+      state.comp_node = comp_nodes[j];
+      state.left_done = true;
+    }
+    else {
+      state.stack_node = stack_nodes[next_push++];
+      state.comp_node = comp_nodes[j];
+      state.stack_depth++;
+      state.left_done = false;
+      state.pop_to = p;
+    }
+
+    state.last_word = words[j];
+    states.push_back(state);
+    r[j] = states.size() - 1;
+  }
+
+  has_log_probs.resize(states.size(), false);
+  return r;
+}
+
+bool NativeDecoder::Finishes(unsigned p, WordId word) const {
+  return word == model.done_with_right && states[p].stack_depth == 0;
+}
+
+bool NativeDecoder::IsDone(unsigned p) const {
+  return states[p].stack_depth == (unsigned)-1;
+}
+
+bool NativeDecoder::IsLegal(unsigned p, WordId word) const {
+  const State& state = states[p];
+  if (word == model.done_with_left) {
+    return !state.left_done && state.stack_depth < 100;
+  }
+  else if (word == model.done_with_right) {
+    return !IsDone(p) && state.left_done;
+  }
+  return true;
+}
+
+void NativeDecoder::ComputeHidden(unsigned p) {
+  const State& state = states[p];
+  const unsigned d = model.stack_lstm.hidden_dim;
+  output_state.resize(2 * d);
+  output_state.head(d) = model.stack_lstm.Output(Node(model.stack_lstm, state.stack_node));
+  output_state.tail(d) = model.comp_lstm.Output(Node(model.comp_lstm, state.comp_node));
+
+  hidden = model.wHb;
+  model.wIH.MultiplyAdd(output_state, hidden);
+  hidden = hidden.array().tanh();
+  if (model.has_output_projection) {
+    projected.setZero(model.wHP.rows());
+    model.wHP.MultiplyAdd(hidden, projected);
+  }
+}
+
+void NativeDecoder::ComputeClassLogProbs() {
+  class_log_probs = model.wCb;
+  class_log_probs.noalias() += model.wHC * hidden;
+  LogSoftmax(class_log_probs);
+}
+
+void NativeDecoder::ComputeWordLogProbs(unsigned c, NativeVector& out) {
+  const vector<unsigned>& words = model.class_words[c];
+  out.resize(words.size());
+  model.wHO.MultiplyRows(words, model.has_output_projection ? projected : hidden, out);
+  for (unsigned i = 0; i < words.size(); ++i) {
+    out(i) += model.wOb(words[i]);
+  }
+  LogSoftmax(out);
+  out.array() += class_log_probs(c);
+}
+
+const NativeVector& NativeDecoder::LogProbabilities(unsigned p) {
+  ComputeLogProbabilities(vector<unsigned>(1, p));
+  return log_probs[p];
+}
+
+// The output states of the whole batch are stacked into a matrix, so that
+// each layer of the final MLP is one matrix-matrix product
+void NativeDecoder::ComputeBatchScores(const vector<unsigned>& ps, bool with_scores) {
+  const unsigned d = model.stack_lstm.hidden_dim;
+  const unsigned batch_size = ps.size();
+  batch_x.resize(2 * d, batch_size);
+  for (unsigned j = 0; j < batch_size; ++j) {
+    const State& state = states[ps[j]];
+    batch_x.col(j).head(d) = model.stack_lstm.Output(Node(model.stack_lstm, state.stack_node));
+    batch_x.col(j).tail(d) = model.comp_lstm.Output(Node(model.comp_lstm, state.comp_node));
+  }
+
+  batch_hidden = model.wHb.replicate(1, batch_size);
+  model.wIH.MultiplyAdd(batch_x, batch_hidden);
+  batch_hidden = batch_hidden.array().tanh();
+  if (model.has_output_projection) {
+    batch_projected.setZero(model.wHP.rows(), batch_size);
+    model.wHP.MultiplyAdd(batch_hidden, batch_projected);
+  }
+  if (!with_scores) {
+    return;
+  }
+
+  batch_scores = model.wOb.replicate(1, batch_size);
+  model.wHO.MultiplyAdd(model.has_output_projection ? batch_projected : batch_hidden, batch_scores);
+  if (model.class_factored) {
+    batch_next = model.wCb.replicate(1, batch_size);
+    batch_next.noalias() += model.wHC * batch_hidden;
+  }
+}
+
+void NativeDecoder::ComputeLogProbabilities(const vector<unsigned>& ps) {
+  vector<unsigned> todo;
+  for (unsigned p : ps) {
+    if (!has_log_probs[p] && find(todo.begin(), todo.end(), p) == todo.end()) {
+      todo.push_back(p);
+    }
+  }
+  if (todo.size() == 0) {
+    return;
+  }
+
+  const unsigned batch_size = todo.size();
+  ComputeBatchScores(todo, shortlist == nullptr);
+  if (log_probs.size() < states.size()) {
+    log_probs.resize(states.size());
+  }
+  if (shortlist != nullptr) {
+    ComputeShortlistLogProbs(todo);
+    return;
+  }
+
+  for (unsigned j = 0; j < batch_size; ++j) {
+    NativeVector& r = log_probs[todo[j]];
+    r = batch_scores.col(j);
+    if (model.class_factored) {
+      // Normalize within each class, then add the class's log probability
+      class_log_probs = batch_next.col(j);
+      LogSoftmax(class_log_probs);
+      for (unsigned c = 0; c < model.class_words.size(); ++c) {
+        const vector<unsigned>& words = model.class_words[c];
+        float m = r(words[0]);
+        for (unsigned w : words) {
+          m = max(m, r(w));
+        }
+        float z = 0.0f;
+        for (unsigned w : words) {
+          z += exp(r(w) - m);
+        }
+        const float offset = class_log_probs(c) - m - log(z);
+        for (unsigned w : words) {
+          r(w) += offset;
+        }
+      }
+    }
+    else {
+      LogSoftmax(r);
+    }
+    has_log_probs[todo[j]] = true;
+  }
+}
+
+void NativeDecoder::ComputeShortlistLogProbs(const vector<unsigned>& todo) {
+  const unsigned batch_size = todo.size();
+  shortlist_words.resize(batch_size);
+  shortlist_union.clear();
+  shortlist_positions.assign(model.VocabSize(), -1);
+  for (unsigned j = 0; j < batch_size; ++j) {
+    shortlist->Words(states[todo[j]].last_word, shortlist_words[j]);
+    for (unsigned w : shortlist_words[j]) {
+      if (shortlist_positions[w] == -1) {
+        shortlist_positions[w] = shortlist_union.size();
+        shortlist_union.push_back(w);
+      }
+    }
+  }
+
+  batch_scores.resize(shortlist_union.size(), batch_size);
+  model.wHO.MultiplyRows(shortlist_union, model.has_output_projection ? batch_projected : batch_hidden, batch_scores);
+  for (unsigned k = 0; k < shortlist_union.size(); ++k) {
+    batch_scores.row(k).array() += model.wOb(shortlist_union[k]);
+  }
+
+  for (unsigned j = 0; j < batch_size; ++j) {
+    const vector<unsigned>& words = shortlist_words[j];
+    scores.resize(words.size());
+    for (unsigned i = 0; i < words.size(); ++i) {
+      scores(i) = batch_scores(shortlist_positions[words[i]], j);
+    }
+    LogSoftmax(scores);
+
+    NativeVector& r = log_probs[todo[j]];
+    r.setConstant(model.VocabSize(), -numeric_limits<float>::infinity());
+    for (unsigned i = 0; i < words.size(); ++i) {
+      r(words[i]) = scores(i);
+    }
+    has_log_probs[todo[j]] = true;
+  }
+}
+
+// Unlike LogProbabilities(), does not keep the distribution around, and
+// for class-factored models only scores the word's own class
+float NativeDecoder::Loss(unsigned p, WordId word) {
+  if (has_log_probs[p] || shortlist != nullptr) {
+    return -LogProbabilities(p)(word);
+  }
+
+  ComputeHidden(p);
+  if (!model.class_factored) {
+    scores = model.wOb;
+    model.wHO.MultiplyAdd(model.has_output_projection ? projected : hidden, scores);
+    return LogSumExp(scores) - scores(word);
+  }
+
+  ComputeClassLogProbs();
+  const unsigned c = model.word_class[word];
+  ComputeWordLogProbs(c, scores);
+  const vector<unsigned>& words = model.class_words[c];
+  unsigned i = find(words.begin(), words.end(), (unsigned)word) - words.begin();
+  return -scores(i);
+}
+
+// Like Loss(), keeps no distributions around: the states are scored
+// together in batch_scores, which is overwritten by the next batch
+vector<float> NativeDecoder::Losses(const vector<unsigned>& ps, const vector<WordId>& words) {
+  assert (ps.size() == words.size());
+  vector<float> r(ps.size());
+  if (shortlist != nullptr) {
+    for (unsigned k = 0; k < ps.size(); ++k) {
+      r[k] = Loss(ps[k], words[k]);
+    }
+    return r;
+  }
+
+  // The column of batch_scores for each pair, or -1 if its state already
+  // has its log probabilities
+  vector<unsigned> todo;
+  vector<int> columns(ps.size(), -1);
+  for (unsigned k = 0; k < ps.size(); ++k) {
+    if (has_log_probs[ps[k]]) {
+      continue;
+    }
+    columns[k] = find(todo.begin(), todo.end(), ps[k]) - todo.begin();
+    if (columns[k] == (int)todo.size()) {
+      todo.push_back(ps[k]);
+    }
+  }
+  if (todo.size() > 0) {
+    ComputeBatchScores(todo, true);
+  }
+
+  for (unsigned k = 0; k < ps.size(); ++k) {
+    const WordId word = words[k];
+    if (columns[k] == -1) {
+      r[k] = -log_probs[ps[k]](word);
+      continue;
+    }
+
+    scores = batch_scores.col(columns[k]);
+    if (!model.class_factored) {
+      r[k] = LogSumExp(scores) - scores(word);
+      continue;
+    }
+
+    // Only the word's own class needs normalizing
+    class_log_probs = batch_next.col(columns[k]);
+    LogSoftmax(class_log_probs);
+    const unsigned c = model.word_class[word];
+    const vector<unsigned>& class_words = model.class_words[c];
+    float m = scores(class_words[0]);
+    for (unsigned w : class_words) {
+      m = max(m, scores(w));
+    }
+    float z = 0.0f;
+    for (unsigned w : class_words) {
+      z += exp(scores(w) - m);
+    }
+    r[k] = -(scores(word) - m - log(z) + class_log_probs(c));
+  }
+  return r;
+}
+
+KBestList<WordId> NativeDecoder::PredictKBest(unsigned p, unsigned K) {
+  const NativeVector& lp = LogProbabilities(p);
+  vector<unsigned> excluded;
+  for (WordId w : {model.done_with_left, model.done_with_right}) {
+    if (!IsLegal(p, w)) {
+      excluded.push_back(w);
+    }
+  }
+  KBestList<unsigned> best_ids = TopK(lp.data(), lp.size(), K, excluded);
+
+  // Re-adding from worst to best keeps tied words in their original order
+  const auto& ids = best_ids.hypothesis_list();
+  KBestList<WordId> kbest(K);
+  for (int i = (int)ids.size() - 1; i >= 0; --i) {
+    kbest.add(ids[i].first, ids[i].second);
+  }
+  return kbest;
+}
+
+pair<WordId, float> NativeDecoder::Sample(unsigned p) {
+  // Class-factored models first pick a class, then a word within it. The
+  // illegal structural words have classes of their own.
+  if (model.class_factored) {
+    ComputeHidden(p);
+    ComputeClassLogProbs();
+    vector<float> class_probs(class_log_probs.size());
+    for (unsigned c = 0; c < class_probs.size(); ++c) {
+      class_probs[c] = exp(class_log_probs(c));
+    }
+    for (WordId w : {model.done_with_left, model.done_with_right}) {
+      if (!IsLegal(p, w)) {
+        assert (model.class_words[model.word_class[w]].size() == 1);
+        class_probs[model.word_class[w]] = 0.0f;
+      }
+    }
+
+    float s = 0.0f;
+    for (float prob : class_probs) {
+      s += prob;
+    }
+    for (unsigned c = 0; c < class_probs.size(); ++c) {
+      class_probs[c] /= s;
+    }
+
+    // With the class log probabilities zeroed, ComputeWordLogProbs gives
+    // probabilities conditioned on the class
+    unsigned c = ::Sample(class_probs);
+    class_log_probs.setZero();
+    ComputeWordLogProbs(c, scores);
+    vector<float> word_probs(scores.size());
+    for (unsigned i = 0; i < word_probs.size(); ++i) {
+      word_probs[i] = exp(scores(i));
+    }
+    unsigned i = ::Sample(word_probs);
+    return make_pair((WordId)model.class_words[c][i], log(class_probs[c]) + log(word_probs[i]));
+  }
+
+  const NativeVector& lp = LogProbabilities(p);
+  vector<float> ps(lp.size());
+  float s = 0.0f;
+  for (unsigned i = 0; i < ps.size(); ++i) {
+    ps[i] = IsLegal(p, i) ? exp(lp(i)) : 0.0f;
+    s += ps[i];
+  }
+  for (unsigned i = 0; i < ps.size(); ++i) {
+    ps[i] /= s;
+  }
+
+  unsigned id = ::Sample(ps);
+  return make_pair((WordId)id, log(ps[id]));
+}
+
+float NativeDecoder::SentenceLoss(const SentenceView& sentence) {
+  Reset();
+  float loss = 0.0f;
+  unsigned p = 0;
+  for (WordId word : sentence) {
+    loss += Loss(p, word);
+    p = AddInput(word, p);
+  }
+  return loss;
+}
@@ -0,0 +1,215 @@
+#pragma once
+#include <vector>
+#include <Eigen/Dense>
+#include "deplm.h"
+#include "kbestlist.h"
+#include "quantize.h"
+#include "shortlist.h"
+#include "utils.h"
+
+using namespace std;
+
+typedef Eigen::MatrixXf NativeMatrix;
+typedef Eigen::VectorXf NativeVector;
+
+// One weight matrix of a NativeModel. It is kept as floats until Quantize()
+// replaces it with an int8 copy, after which products with it are computed
+// by QuantizedMatrix's kernels instead of by Eigen.
+class NativeWeights {
+public:
+  NativeWeights();
+  NativeWeights(const NativeMatrix& m);
+
+  void Quantize();
+  unsigned rows() const;
+  unsigned cols() const;
+  size_t Bytes() const;
+
+  // out += this * x
+  void MultiplyAdd(const Eigen::Ref<const NativeMatrix>& x, Eigen::Ref<NativeMatrix> out) const;
+  // out.row(k) = this->row(rows[k]) * x, with out already sized to match
+  void MultiplyRows(const vector<unsigned>& rows, const Eigen::Ref<const NativeMatrix>& x, Eigen::Ref<NativeMatrix> out) const;
+
+private:
+  // Row major, so that single rows are contiguous
+  typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMajorMatrix;
+
+  bool quantized;
+  RowMajorMatrix floats;
+  QuantizedMatrix quantized_values;
+};
+
+// One of the two LSTMs of a DependencyOutputModel, with the weights of each
+// layer's three gates stacked (in the order input, cell, output) so that a
+// step costs one matrix-vector product for the input and one for the
+// previous hidden state. Mirrors dynet's LSTMBuilder, which couples the
+// forget gate to the input gate and has peephole connections from the cell.
+struct NativeLSTM {
+  struct Layer {
+    NativeWeights x2g; // (3 * hidden_dim) x input_dim
+    NativeWeights h2g; // (3 * hidden_dim) x hidden_dim
+    NativeVector bg;
+    NativeWeights c2i;
+    NativeWeights c2o;
+  };
+
+  // A state holds each layer's cell followed by each layer's hidden vector,
+  // in the same layout as LSTMBuilder::get_s()
+  NativeLSTM();
+  NativeLSTM(const LSTMBuilder& lstm, const NativeVector& initial_cells);
+
+  // Computes the states after reading x from states prev, one step per
+  // column. gates is scratch space. prev and next must not be the same
+  // matrix.
+  void Step(const NativeMatrix& prev, const NativeMatrix& x, NativeMatrix& next, NativeMatrix& gates) const;
+  // The last layer's hidden vector of the given state
+  Eigen::Map<const NativeVector> Output(const NativeVector& state) const;
+  void Quantize();
+  size_t Bytes() const;
+
+  vector<Layer> layers;
+  unsigned hidden_dim;
+  NativeVector initial_state;
+};
+
+// An inference-only copy of a trained DependencyOutputModel's weights.
+// It runs the model with plain Eigen arithmetic on preallocated buffers,
+// without building any dynet computation graphs. The weights are read-only
+// once constructed, so one NativeModel can be shared by any number of
+// NativeDecoders.
+class NativeModel {
+public:
+  explicit NativeModel(const DependencyOutputModel& model);
+
+  unsigned VocabSize() const;
+
+  // Converts the LSTMs' weights and the final MLP's weight matrices to
+  // int8, shrinking them about four times. The input table, biases and
+  // class softmax stay as floats. Must be called
+  // before any NativeDecoder starts using the model.
+  void Quantize();
+  // Total size of the weight matrices that Quantize() converts
+  size_t QuantizableBytes() const;
+
+private:
+  friend class NativeDecoder;
+
+  NativeLSTM stack_lstm;
+  NativeLSTM comp_lstm;
+  // emb_transform times each word's embedding, one column per word, so that
+  // feeding a word to the LSTMs costs no product at all
+  NativeMatrix inputs;
+
+  NativeWeights wIH;
+  NativeVector wHb;
+  NativeWeights wHO; // With tied embeddings, a copy of the embedding table
+  NativeVector wOb;
+  // With tied embeddings of a different size than the hidden layer, the
+  // hidden layer is multiplied by wHP before wHO
+  bool has_output_projection;
+  NativeWeights wHP;
+
+  // Class-factored output layer, if the model has one
+  bool class_factored;
+  NativeMatrix wHC;
+  NativeVector wCb;
+  vector<unsigned> word_class;
+  vector<vector<unsigned>> class_words;
+
+  WordId done_with_left;
+  WordId done_with_right;
+};
+
+// The decoding state of one sentence (or one beam search) over a
+// NativeModel. States are numbered like DependencyOutputModel's state
+// pointers: Reset() leaves only the initial state, 0, and each call to
+// AddInput() creates a new one.
+class NativeDecoder {
+public:
+  explicit NativeDecoder(const NativeModel& model);
+
+  void Reset();
+  // Restricts LogProbabilities, and with it PredictKBest and Sample, to
+  // the given shortlist. Words outside it get a log probability of -inf.
+  // Pass null to go back to the full vocabulary.
+  void SetShortlist(const Shortlist* shortlist);
+  unsigned AddInput(WordId word, unsigned p);
+  bool IsDone(unsigned p) const;
+  // Whether word may follow state p: </LEFT> and </RIGHT> only where the
+  // tree structure allows them. Does not check whether p IsDone.
+  bool IsLegal(unsigned p, WordId word) const;
+  // Whether adding word at state p would finish the sentence
+  bool Finishes(unsigned p, WordId word) const;
+
+  // Batched versions of AddInput and LogProbabilities, which push the whole
+  // batch through each weight matrix with a single matrix-matrix product.
+  // AddInputs returns the new state of each (word, state) pair.
+  vector<unsigned> AddInputs(const vector<WordId>& words, const vector<unsigned>& ps);
+  void ComputeLogProbabilities(const vector<unsigned>& ps);
+
+  // Log probabilities of every word at state p. Computed once per state.
+  const NativeVector& LogProbabilities(unsigned p);
+  float Loss(unsigned p, WordId word);
+  // Loss of each (state, word) pair, with the states' output layers computed
+  // as one batch
+  vector<float> Losses(const vector<unsigned>& ps, const vector<WordId>& words);
+  KBestList<WordId> PredictKBest(unsigned p, unsigned K);
+  pair<WordId, float> Sample(unsigned p);
+
+  // Total negative log probability of a whole sentence
+  float SentenceLoss(const SentenceView& sentence);
+
+private:
+  struct State {
+    int stack_node; // -1 means the LSTM's initial state
+    int comp_node;
+    unsigned stack_depth;
+    bool left_done;
+    int pop_to; // Where </RIGHT> would go back to
+    WordId last_word; // The word that led to this state, or -1
+  };
+
+  const NativeVector& Node(const NativeLSTM& lstm, int node) const;
+  // Steps lstm once per column of x, from the nodes in prev, and stores the
+  // resulting nodes in the arena
+  void Step(const NativeLSTM& lstm, const vector<int>& prev, const NativeMatrix& x, vector<int>& next);
+  // Fills in batch_hidden (and batch_projected) with the final MLP's hidden
+  // layer at each of the states, and if with_scores, batch_scores (and, for
+  // class-factored models, the class scores in batch_next) with its output
+  void ComputeBatchScores(const vector<unsigned>& ps, bool with_scores);
+  // Fills in hidden with the final MLP's hidden layer at state p
+  void ComputeHidden(unsigned p);
+  // Fills in class_log_probs from hidden
+  void ComputeClassLogProbs();
+  // Log probabilities of the words of class c, given hidden and class_log_probs
+  void ComputeWordLogProbs(unsigned c, NativeVector& out);
+  // Fills in log_probs for each state in todo from batch_hidden, scoring
+  // only the union of their shortlists
+  void ComputeShortlistLogProbs(const vector<unsigned>& todo);
+
+  const NativeModel& model;
+  const Shortlist* shortlist;
+  vector<State> states;
+  vector<NativeVector> nodes; // Shared by both LSTMs. Reused across Reset()s.
+  unsigned node_count;
+  vector<NativeVector> log_probs;
+  vector<bool> has_log_probs;
+
+  // Scratch buffers, reused across calls
+  NativeVector output_state;
+  NativeVector hidden;
+  NativeVector projected;
+  NativeVector scores;
+  NativeVector class_log_probs;
+  NativeMatrix gates;
+  NativeMatrix batch_inputs;
+  NativeMatrix batch_x;
+  NativeMatrix batch_prev;
+  NativeMatrix batch_next;
+  NativeMatrix batch_hidden;
+  NativeMatrix batch_projected;
+  NativeMatrix batch_scores;
+  vector<vector<unsigned>> shortlist_words;
+  vector<unsigned> shortlist_union;
+  vector<int> shortlist_positions;
+};
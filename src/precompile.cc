@@ -0,0 +1,62 @@
+#include <iostream>
+#include <boost/program_options.hpp>
+#include "deplm.h"
+#include "utils.h"
+#include "io.h"
+
+using namespace dynet;
+using namespace std;
+namespace po = boost::program_options;
+
+// Converts a text file into a corpus cache, which train and loss can then
+// memory-map instead of re-reading and re-tokenizing the text every time.
+int main(int argc, char** argv) {
+  dynet::initialize(argc, argv, true);
+
+  po::options_description desc("description");
+  desc.add_options()
+  ("help", "Display this help message")
+  ("text", po::value<string>()->required(), "Input text")
+  ("output", po::value<string>()->required(), "Output corpus cache file")
+  ("model", po::value<string>(), "Use the vocabulary of this trained model")
+  ("vocab", po::value<string>(), "Use the vocabulary of this corpus cache (e.g. that of the training text, when caching the dev text)");
+
+  po::positional_options_description positional_options;
+  positional_options.add("text", 1);
+  positional_options.add("output", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(positional_options).run(), vm);
+
+  if (vm.count("help")) {
+    cerr << desc;
+    return 1;
+  }
+
+  po::notify(vm);
+
+  if (vm.count("model") && vm.count("vocab")) {
+    cerr << "Invalid parameters: Please specify at most one of --model and --vocab." << endl;
+    return 1;
+  }
+
+  Dict vocab;
+  if (vm.count("model")) {
+    Model dynet_model;
+    DependencyOutputModel model;
+    Trainer* trainer = nullptr;
+    Deserialize(vm["model"].as<string>(), vocab, model, dynet_model, trainer);
+  }
+  else if (vm.count("vocab")) {
+    // Mirror what train does to the vocabulary after reading the training text
+    MapCorpusCache(vm["vocab"].as<string>(), vocab);
+    vocab.freeze();
+    vocab.set_unk("UNK");
+  }
+
+  Corpus corpus = ReadCorpus(vm["text"].as<string>(), vocab);
+  WriteCorpusCache(vm["output"].as<string>(), corpus, vocab);
+  cerr << "Wrote " << corpus.size() << " sentences (" << corpus.word_count() << " words) with a vocabulary of " << vocab.size() << " words." << endl;
+
+  return 0;
+}
@@ -3,6 +3,7 @@
 #include <boost/program_options.hpp>
 #include <boost/algorithm/string/join.hpp>
 #include "deplm.h"
+#include "native.h"
 #include "utils.h"
 #include "io.h"
 
@@ -11,7 +12,11 @@ using namespace dynet::expr;
 using namespace std;
 namespace po = boost::program_options;
 
-KBestList<shared_ptr<OutputSentence>> DoBeamSearch(OutputModel* output_model, unsigned K, unsigned beam_size, unsigned max_length, float length_bonus) {
+// If compact_every is non-zero, every compact_every steps the model is asked
+// to throw away all states that the surviving hypotheses no longer need, so
+// that memory use stays proportional to the beam rather than to everything
+// ever explored.
+KBestList<shared_ptr<OutputSentence>> DoBeamSearch(OutputModel* output_model, unsigned K, unsigned beam_size, unsigned max_length, float length_bonus, unsigned compact_every) {
   assert (beam_size >= K);
   ComputationGraph cg;
   output_model->NewGraph(cg);
@@ -23,6 +28,12 @@ KBestList<shared_ptr<OutputSentence>> DoBeamSearch(OutputModel* output_model, un
   for (unsigned length = 0; length < max_length; ++length) {
     KBestList<pair<shared_ptr<OutputSentence>, RNNPointer>> new_hyps(beam_size);
 
+    vector<RNNPointer> beam_states;
+    for (auto& hyp : top_hyps.hypothesis_list()) {
+      beam_states.push_back(get<1>(get<1>(hyp)));
+    }
+    output_model->PrecomputeLogDistributions(beam_states);
+
     for (auto& hyp : top_hyps.hypothesis_list()) {
       double hyp_score = get<0>(hyp);
 
@@ -63,6 +74,110 @@ KBestList<shared_ptr<OutputSentence>> DoBeamSearch(OutputModel* output_model, un
       }
     }
     top_hyps = new_hyps;
+
+    if (compact_every > 0 && (length + 1) % compact_every == 0) {
+      vector<RNNPointer> live;
+      for (auto& hyp : top_hyps.hypothesis_list()) {
+        live.push_back(get<1>(get<1>(hyp)));
+      }
+      live = output_model->Compact(live);
+
+      // Re-adding from worst to best keeps tied hypotheses in their original order
+      const auto& old_hyps = top_hyps.hypothesis_list();
+      KBestList<pair<shared_ptr<OutputSentence>, RNNPointer>> compacted_hyps(beam_size);
+      for (int i = (int)old_hyps.size() - 1; i >= 0; --i) {
+        compacted_hyps.add(old_hyps[i].first, make_pair(get<0>(old_hyps[i].second), live[i]));
+      }
+      top_hyps = compacted_hyps;
+    }
+  }
+
+  for (auto& hyp : top_hyps.hypothesis_list()) {
+    double score = get<0>(hyp);
+    shared_ptr<OutputSentence> sentence = get<0>(get<1>(hyp));
+    complete_hyps.add(score, sentence);
+  }
+  return complete_hyps;
+}
+
+// The same search as DoBeamSearch, run on the native inference engine.
+// Each step scores the whole beam with one pass through the output layer,
+// and only the expansions that survive pruning are run through the LSTMs,
+// again all at once.
+// Each hypothesis's state lives in the decoder for the whole search; no
+// compaction is needed, since native states cost only their LSTM vectors.
+KBestList<shared_ptr<OutputSentence>> DoNativeBeamSearch(NativeDecoder& decoder, unsigned K, unsigned beam_size, unsigned max_length, float length_bonus) {
+  assert (beam_size >= K);
+  decoder.Reset();
+
+  KBestList<shared_ptr<OutputSentence>> complete_hyps(K);
+  KBestList<pair<shared_ptr<OutputSentence>, unsigned>> top_hyps(beam_size);
+  top_hyps.add(0.0, make_pair(make_shared<OutputSentence>(), 0));
+
+  for (unsigned length = 0; length < max_length; ++length) {
+    vector<unsigned> beam_states;
+    for (auto& hyp : top_hyps.hypothesis_list()) {
+      beam_states.push_back(get<1>(get<1>(hyp)));
+    }
+    decoder.ComputeLogProbabilities(beam_states);
+
+    // An unfinished expansion is kept as (prefix, prefix's state, new word)
+    // until the step is over
+    KBestList<tuple<shared_ptr<OutputSentence>, unsigned, WordId>> new_hyps(beam_size);
+
+    for (auto& hyp : top_hyps.hypothesis_list()) {
+      double hyp_score = get<0>(hyp);
+
+      // See DoBeamSearch for why this early termination is safe
+      const float buffer = length_bonus;
+      if (complete_hyps.size() >= K && hyp_score < complete_hyps.worst_score() - buffer) {
+        break;
+      }
+
+      if (new_hyps.size() >= K && hyp_score < new_hyps.worst_score() - buffer) {
+        break;
+      }
+
+      shared_ptr<OutputSentence> hyp_sentence = get<0>(get<1>(hyp));
+      unsigned state_pointer = get<1>(get<1>(hyp));
+      assert (hyp_sentence->size() == length);
+      KBestList<WordId> best_words = decoder.PredictKBest(state_pointer, beam_size);
+
+      for (auto& w : best_words.hypothesis_list()) {
+        double word_score = get<0>(w);
+        WordId word = get<1>(w);
+        double new_score = hyp_score + word_score;
+        if (!decoder.Finishes(state_pointer, word)) {
+          new_score += length_bonus;
+          new_hyps.add(new_score, make_tuple(hyp_sentence, state_pointer, word));
+        }
+        else {
+          shared_ptr<OutputSentence> new_sentence(new OutputSentence(*hyp_sentence));
+          new_sentence->push_back(make_shared<StandardWord>(word));
+          complete_hyps.add(new_score, new_sentence);
+        }
+      }
+    }
+
+    const auto& expansions = new_hyps.hypothesis_list();
+    vector<WordId> words;
+    vector<unsigned> prev_states;
+    for (auto& expansion : expansions) {
+      prev_states.push_back(get<1>(expansion.second));
+      words.push_back(get<2>(expansion.second));
+    }
+    vector<unsigned> new_states;
+    if (words.size() > 0) {
+      new_states = decoder.AddInputs(words, prev_states);
+    }
+
+    // Re-adding from worst to best keeps tied hypotheses in their original order
+    top_hyps = KBestList<pair<shared_ptr<OutputSentence>, unsigned>>(beam_size);
+    for (int i = (int)expansions.size() - 1; i >= 0; --i) {
+      shared_ptr<OutputSentence> new_sentence(new OutputSentence(*get<0>(expansions[i].second)));
+      new_sentence->push_back(make_shared<StandardWord>(words[i]));
+      top_hyps.add(expansions[i].first, make_pair(new_sentence, new_states[i]));
+    }
   }
 
   for (auto& hyp : top_hyps.hypothesis_list()) {
@@ -97,7 +212,12 @@ int main(int argc, char** argv) {
   ("kbest_size,k", po::value<unsigned>()->default_value(1), "K-best list size")
   ("beam_size,b", po::value<unsigned>()->default_value(10), "Beam size")
   ("max_length", po::value<unsigned>()->default_value(100), "Maximum length of output sentences")
-  ("length_bonus", po::value<float>()->default_value(0.0f), "Length bonus per word");
+  ("length_bonus", po::value<float>()->default_value(0.0f), "Length bonus per word")
+  ("compact_every", po::value<unsigned>()->default_value(0), "Discard pruned hypotheses' states every this many steps, bounding memory by the beam size. 0 means never")
+  ("native", "Search with the native inference engine instead of building dynet graphs")
+  ("quantize", "Run the native inference engine with int8 weights. Implies --native")
+  ("input_cache", po::value<string>(), "Keep the precomputed input of every word in this file, and reuse it on later runs")
+  ("shortlist", po::value<string>(), "Only consider the words of this shortlist (see make_shortlist) at each step");
 
   po::positional_options_description positional_options;
   positional_options.add("model", 1);
@@ -113,6 +233,15 @@ int main(int argc, char** argv) {
 
   po::notify(vm);
 
+  if (vm["kbest_size"].as<unsigned>() == 0) {
+    cerr << "Invalid parameters: --kbest_size must be at least 1." << endl;
+    return 1;
+  }
+  if (vm["beam_size"].as<unsigned>() < vm["kbest_size"].as<unsigned>()) {
+    cerr << "Invalid parameters: --beam_size must be at least --kbest_size." << endl;
+    return 1;
+  }
+
   Dict vocab;
   Model dynet_model;
   DependencyOutputModel* model = new DependencyOutputModel();
@@ -123,9 +252,30 @@ int main(int argc, char** argv) {
   const unsigned beam_size = vm["beam_size"].as<unsigned>();
   const unsigned max_length = vm["max_length"].as<unsigned>();
   const float length_bonus = vm["length_bonus"].as<float>();
+  const unsigned compact_every = vm["compact_every"].as<unsigned>();
   Deserialize(model_filename, vocab, *model, dynet_model, trainer);
+  model->PrecomputeInputs(vm.count("input_cache") ? vm["input_cache"].as<string>() : "");
+
+  Shortlist shortlist;
+  if (vm.count("shortlist")) {
+    shortlist = LoadShortlist(vm["shortlist"].as<string>());
+  }
+  const Shortlist* shortlist_ptr = vm.count("shortlist") ? &shortlist : nullptr;
 
-  KBestList<shared_ptr<OutputSentence>> kbest = DoBeamSearch(model, kbest_size, beam_size, max_length, length_bonus);
+  KBestList<shared_ptr<OutputSentence>> kbest;
+  if (vm.count("native") || vm.count("quantize")) {
+    NativeModel native_model(*model);
+    if (vm.count("quantize")) {
+      native_model.Quantize();
+    }
+    NativeDecoder decoder(native_model);
+    decoder.SetShortlist(shortlist_ptr);
+    kbest = DoNativeBeamSearch(decoder, kbest_size, beam_size, max_length, length_bonus);
+  }
+  else {
+    model->SetShortlist(shortlist_ptr);
+    kbest = DoBeamSearch(model, kbest_size, beam_size, max_length, length_bonus, compact_every);
+  }
   OutputKBestList(0, kbest, vocab);
 
   return 0;
@@ -0,0 +1,85 @@
+#include <iostream>
+#include <cmath>
+#include <boost/program_options.hpp>
+#include "deplm.h"
+#include "native.h"
+#include "quantize.h"
+#include "utils.h"
+#include "io.h"
+
+using namespace dynet;
+using namespace std;
+namespace po = boost::program_options;
+
+// Scores a text with the native inference engine twice, once with float
+// weights and once with int8 ones, and reports how much quantization
+// changes the perplexity.
+int main(int argc, char** argv) {
+  dynet::initialize(argc, argv, true);
+
+  po::options_description desc("description");
+  desc.add_options()
+  ("help", "Display this help message")
+  ("model", po::value<string>()->required(), "Trained model")
+  ("text", po::value<string>()->required(), "Input text")
+  ("verbose", "Print both losses of every sentence");
+
+  po::positional_options_description positional_options;
+  positional_options.add("model", 1);
+  positional_options.add("text", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(positional_options).run(), vm);
+
+  if (vm.count("help")) {
+    cerr << desc;
+    return 1;
+  }
+
+  po::notify(vm);
+
+  Dict vocab;
+  Model dynet_model;
+  DependencyOutputModel* model = new DependencyOutputModel();
+  Trainer* trainer = nullptr;
+
+  const bool verbose = vm.count("verbose") > 0;
+  const string model_filename = vm["model"].as<string>();
+  const string text_filename = vm["text"].as<string>();
+  Deserialize(model_filename, vocab, *model, dynet_model, trainer);
+
+  Corpus input_text = ReadCorpus(text_filename, vocab);
+
+  NativeModel float_model(*model);
+  NativeModel int8_model(*model);
+  int8_model.Quantize();
+  NativeDecoder float_decoder(float_model);
+  NativeDecoder int8_decoder(int8_model);
+
+  double float_loss = 0.0;
+  double int8_loss = 0.0;
+  double max_difference = 0.0;
+  for (unsigned i = 0; i < input_text.size(); ++i) {
+    float f = float_decoder.SentenceLoss(input_text[i]);
+    float q = int8_decoder.SentenceLoss(input_text[i]);
+    if (verbose) {
+      cout << i << " ||| " << f << " ||| " << q << endl;
+    }
+    float_loss += f;
+    int8_loss += q;
+    max_difference = max(max_difference, (double)fabs(q - f));
+  }
+
+  const double word_count = input_text.word_count();
+  const double float_perplexity = exp(float_loss / word_count);
+  const double int8_perplexity = exp(int8_loss / word_count);
+  cerr << "Kernel: " << QuantizedMatrix::KernelName() << endl;
+  cerr << "Weights: " << float_model.QuantizableBytes() / 1048576.0 << " MB as floats, "
+       << int8_model.QuantizableBytes() / 1048576.0 << " MB as int8" << endl;
+  cerr << "Words: " << input_text.word_count() << " in " << input_text.size() << " sentences" << endl;
+  cerr << "Perplexity: " << float_perplexity << " with floats, " << int8_perplexity << " with int8 ("
+       << 100.0 * (int8_perplexity - float_perplexity) / float_perplexity << "% change)" << endl;
+  cerr << "Largest change in a sentence's loss: " << max_difference << endl;
+
+  return 0;
+}
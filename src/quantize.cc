@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include "quantize.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QUANTIZE_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+const unsigned kBlock = 32;
+
+typedef int32_t (*DotFunction)(const int8_t* a, const int8_t* b, unsigned n);
+
+int32_t DotScalar(const int8_t* a, const int8_t* b, unsigned n) {
+  int32_t sum = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    sum += (int32_t)a[i] * b[i];
+  }
+  return sum;
+}
+
+#ifdef QUANTIZE_X86
+__attribute__((target("avx2")))
+int32_t HorizontalSum(__m256i v) {
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+  return _mm_cvtsi128_si32(s);
+}
+
+// Both kernels multiply an unsigned by a signed byte, so a's sign is moved
+// onto b first. Values are in [-127, 127], so |a| fits in a byte and a pair
+// of products cannot saturate maddubs's 16 bit sums.
+__attribute__((target("avx2")))
+int32_t DotAvx2(const int8_t* a, const int8_t* b, unsigned n) {
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i sum = _mm256_setzero_si256();
+  for (unsigned i = 0; i < n; i += kBlock) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+    __m256i products = _mm256_maddubs_epi16(_mm256_sign_epi8(va, va), _mm256_sign_epi8(vb, va));
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(products, ones));
+  }
+  return HorizontalSum(sum);
+}
+
+__attribute__((target("avx2,avx512f,avx512vl,avx512vnni")))
+int32_t DotVnni(const int8_t* a, const int8_t* b, unsigned n) {
+  __m256i sum = _mm256_setzero_si256();
+  for (unsigned i = 0; i < n; i += kBlock) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+    sum = _mm256_dpbusd_epi32(sum, _mm256_sign_epi8(va, va), _mm256_sign_epi8(vb, va));
+  }
+  return HorizontalSum(sum);
+}
+#endif
+
+struct Kernel {
+  Kernel() : dot(DotScalar), name("scalar") {
+#ifdef QUANTIZE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl")) {
+      dot = DotVnni;
+      name = "avx512vnni";
+    }
+    else if (__builtin_cpu_supports("avx2")) {
+      dot = DotAvx2;
+      name = "avx2";
+    }
+#endif
+  }
+
+  DotFunction dot;
+  const char* name;
+};
+
+// Picked once, the first time any product is computed
+const Kernel& GetKernel() {
+  static const Kernel kernel;
+  return kernel;
+}
+
+// Quantizes v to q[0, n), returning the scale that maps q back to v
+float QuantizeVector(const float* v, unsigned stride, unsigned n, int8_t* q) {
+  float max_abs = 0.0f;
+  for (unsigned i = 0; i < n; ++i) {
+    max_abs = max(max_abs, fabs(v[i * stride]));
+  }
+  if (max_abs == 0.0f) {
+    fill(q, q + n, 0);
+    return 0.0f;
+  }
+  const float scale = max_abs / 127.0f;
+  for (unsigned i = 0; i < n; ++i) {
+    q[i] = (int8_t)lrintf(v[i * stride] / scale);
+  }
+  return scale;
+}
+
+} // namespace
+
+QuantizedMatrix::QuantizedMatrix() : row_count(0), col_count(0), padded_cols(0) {}
+
+QuantizedMatrix::QuantizedMatrix(const Eigen::MatrixXf& m) : row_count(m.rows()), col_count(m.cols()) {
+  padded_cols = (col_count + kBlock - 1) / kBlock * kBlock;
+  values.assign((size_t)row_count * padded_cols, 0);
+  scales.resize(row_count);
+  for (unsigned i = 0; i < row_count; ++i) {
+    scales[i] = QuantizeVector(m.data() + i, m.outerStride(), col_count, &values[(size_t)i * padded_cols]);
+  }
+}
+
+size_t QuantizedMatrix::Bytes() const {
+  return values.size() * sizeof(int8_t) + scales.size() * sizeof(float);
+}
+
+const char* QuantizedMatrix::KernelName() {
+  return GetKernel().name;
+}
+
+void QuantizedMatrix::QuantizeColumns(const Eigen::Ref<const Eigen::MatrixXf>& x, vector<int8_t>& q, vector<float>& x_scales) const {
+  assert (x.rows() == col_count);
+  q.assign((size_t)x.cols() * padded_cols, 0);
+  x_scales.resize(x.cols());
+  for (unsigned j = 0; j < x.cols(); ++j) {
+    x_scales[j] = QuantizeVector(x.col(j).data(), 1, col_count, &q[(size_t)j * padded_cols]);
+  }
+}
+
+// Rows are the outer loop, so that each row of the weights is read from
+// memory once per batch rather than once per column
+void QuantizedMatrix::MultiplyAdd(const Eigen::Ref<const Eigen::MatrixXf>& x, Eigen::Ref<Eigen::MatrixXf> out) const {
+  assert (out.rows() == row_count && out.cols() == x.cols());
+  vector<int8_t> q;
+  vector<float> x_scales;
+  QuantizeColumns(x, q, x_scales);
+
+  const DotFunction dot = GetKernel().dot;
+  const unsigned batch_size = x.cols();
+  for (unsigned i = 0; i < row_count; ++i) {
+    const int8_t* row = &values[(size_t)i * padded_cols];
+    for (unsigned j = 0; j < batch_size; ++j) {
+      out(i, j) += dot(row, &q[(size_t)j * padded_cols], padded_cols) * scales[i] * x_scales[j];
+    }
+  }
+}
+
+void QuantizedMatrix::MultiplyRows(const vector<unsigned>& rows, const Eigen::Ref<const Eigen::MatrixXf>& x, Eigen::Ref<Eigen::MatrixXf> out) const {
+  assert (out.rows() == rows.size() && out.cols() == x.cols());
+  vector<int8_t> q;
+  vector<float> x_scales;
+  QuantizeColumns(x, q, x_scales);
+
+  const DotFunction dot = GetKernel().dot;
+  const unsigned batch_size = x.cols();
+  for (unsigned k = 0; k < rows.size(); ++k) {
+    const unsigned i = rows[k];
+    const int8_t* row = &values[(size_t)i * padded_cols];
+    for (unsigned j = 0; j < batch_size; ++j) {
+      out(k, j) = dot(row, &q[(size_t)j * padded_cols], padded_cols) * scales[i] * x_scales[j];
+    }
+  }
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <Eigen/Dense>
+
+using namespace std;
+
+// A float matrix quantized to int8 with one scale per row, for inference.
+// Each row is scaled so that its largest magnitude maps to 127, and is
+// padded with zeros to a multiple of 32 entries so that the SIMD kernels
+// never need a scalar tail. Inputs are quantized the same way, with one
+// scale per column, right before each product. The products themselves are
+// exact int32 dot products, run with AVX-512 VNNI or AVX2 when the CPU
+// supports them, and with plain scalar code otherwise.
+class QuantizedMatrix {
+public:
+  QuantizedMatrix();
+  explicit QuantizedMatrix(const Eigen::MatrixXf& m);
+
+  unsigned rows() const { return row_count; }
+  unsigned cols() const { return col_count; }
+  // Size of the quantized weights and their scales
+  size_t Bytes() const;
+
+  // out += this * x
+  void MultiplyAdd(const Eigen::Ref<const Eigen::MatrixXf>& x, Eigen::Ref<Eigen::MatrixXf> out) const;
+  // out.row(k) = this->row(rows[k]) * x. out must already have one row per
+  // entry of rows, and one column per column of x.
+  void MultiplyRows(const vector<unsigned>& rows, const Eigen::Ref<const Eigen::MatrixXf>& x, Eigen::Ref<Eigen::MatrixXf> out) const;
+
+  // The name of the dot product kernel this CPU uses
+  static const char* KernelName();
+
+private:
+  // Quantizes each column of x into a padded_cols-long int8 vector
+  void QuantizeColumns(const Eigen::Ref<const Eigen::MatrixXf>& x, vector<int8_t>& q, vector<float>& scales) const;
+
+  unsigned row_count;
+  unsigned col_count;
+  unsigned padded_cols;
+  vector<int8_t> values; // Row major, padded_cols per row
+  vector<float> scales; // One per row
+};
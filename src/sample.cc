@@ -3,6 +3,7 @@
 #include <boost/algorithm/string/join.hpp>
 #include "train.h"
 #include "deplm.h"
+#include "native.h"
 #include "utils.h"
 #include "io.h"
 
@@ -31,6 +32,27 @@ tuple<OutputSentence, float> Sample(OutputModel* model, unsigned max_length, Dic
   return make_pair(sent, total_loss);
 }
 
+tuple<vector<WordId>, float> Sample(NativeDecoder& decoder, unsigned max_length) {
+  vector<WordId> sent;
+  float total_loss = 0.0f;
+  decoder.Reset();
+  unsigned p = 0;
+  for (unsigned i = 0; i < max_length; ++i) {
+    WordId word;
+    float word_loss;
+    tie(word, word_loss) = decoder.Sample(p);
+    sent.push_back(word);
+    total_loss += word_loss;
+
+    p = decoder.AddInput(word, p);
+    if (decoder.IsDone(p)) {
+      break;
+    }
+  }
+
+  return make_pair(sent, total_loss);
+}
+
 int main(int argc, char** argv) {
   dynet::initialize(argc, argv, true);
 
@@ -38,7 +60,11 @@ int main(int argc, char** argv) {
   desc.add_options()
   ("help", "Display this help message")
   ("model", po::value<string>()->required(), "Trained model whose grammar will be dumped")
-  ("max_length", po::value<unsigned>()->default_value(300), "Maximum length of output sentences");
+  ("max_length", po::value<unsigned>()->default_value(300), "Maximum length of output sentences")
+  ("native", "Sample with the native inference engine instead of building dynet graphs")
+  ("quantize", "Run the native inference engine with int8 weights. Implies --native")
+  ("input_cache", po::value<string>(), "Keep the precomputed input of every word in this file, and reuse it on later runs")
+  ("shortlist", po::value<string>(), "Only sample words of this shortlist (see make_shortlist)");
 
   AddTrainerOptions(desc);
 
@@ -63,7 +89,35 @@ int main(int argc, char** argv) {
   const string model_filename = vm["model"].as<string>();
   const unsigned max_length = vm["max_length"].as<unsigned>();
   Deserialize(model_filename, vocab, *model, dynet_model, trainer);
+  model->PrecomputeInputs(vm.count("input_cache") ? vm["input_cache"].as<string>() : "");
+
+  Shortlist shortlist;
+  if (vm.count("shortlist")) {
+    shortlist = LoadShortlist(vm["shortlist"].as<string>());
+  }
+  const Shortlist* shortlist_ptr = vm.count("shortlist") ? &shortlist : nullptr;
+
+  if (vm.count("native") || vm.count("quantize")) {
+    NativeModel native_model(*model);
+    if (vm.count("quantize")) {
+      native_model.Quantize();
+    }
+    NativeDecoder decoder(native_model);
+    decoder.SetShortlist(shortlist_ptr);
+    while(true) {
+      vector<WordId> sample;
+      float loss;
+      tie(sample, loss) = Sample(decoder, max_length);
+
+      vector<string> words(sample.size());
+      for (unsigned i = 0; i < sample.size(); ++i) {
+        words[i] = vocab.convert(sample[i]);
+      }
+      cout << loss << " ||| " << boost::algorithm::join(words, " ") << endl;
+    }
+  }
 
+  model->SetShortlist(shortlist_ptr);
   while(true) {
     ComputationGraph cg;
     model->NewGraph(cg);
@@ -0,0 +1,338 @@
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <boost/program_options.hpp>
+#include "dynet/devices.h"
+#include "deplm.h"
+#include "native.h"
+#include "utils.h"
+#include "io.h"
+
+using namespace dynet;
+using namespace std;
+namespace po = boost::program_options;
+
+// Keeps a model loaded and scores sentences sent to it, either one request
+// per line on stdin (answers go to stdout), or over a Unix domain socket
+// with any number of concurrent clients (see bin/client). Requests are
+//   SCORE <sentence>   answered with  <log prob>
+//   TOKENS <sentence>  answered with  <log prob> ||| <log prob of each word>
+// where log probabilities are natural logs, or with ERROR <reason>. When
+// the model file changes, the new model is loaded in the background and
+// each connection switches over at its next request.
+
+// A loaded model, never modified once loaded, so that any number of
+// connections can share it. The vocabulary is frozen, so looking words up
+// in it only reads it.
+struct ServedModel {
+  Dict vocab;
+  unique_ptr<NativeModel> native_model;
+};
+
+// The model new requests should use, swapped out on reload
+class ModelHolder {
+public:
+  shared_ptr<ServedModel> Get() {
+    lock_guard<mutex> lock(m);
+    return current;
+  }
+
+  void Set(shared_ptr<ServedModel> model) {
+    lock_guard<mutex> lock(m);
+    current = model;
+  }
+
+private:
+  mutex m;
+  shared_ptr<ServedModel> current;
+};
+
+struct FileVersion {
+  time_t mtime;
+  ino_t inode;
+
+  bool operator==(const FileVersion& other) const {
+    return mtime == other.mtime && inode == other.inode;
+  }
+};
+
+bool GetFileVersion(const string& filename, FileVersion& version) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    return false;
+  }
+  version.mtime = st.st_mtime;
+  version.inode = st.st_ino;
+  return true;
+}
+
+// Only the native copy of a model is kept, so once it is built the memory
+// that dynet's copy of the parameters took can go to the next reload.
+// Without this, dynet's fixed-size parameter pool would run out after a few
+// reloads.
+void ReleaseParameterMemory() {
+  default_device->pools[(int)DeviceMempool::PS]->free();
+}
+
+// Throws if the file cannot be read as a model
+shared_ptr<ServedModel> LoadModel(const string& filename, bool quantize) {
+  shared_ptr<ServedModel> served = make_shared<ServedModel>();
+  try {
+    Model dynet_model;
+    DependencyOutputModel model;
+    Trainer* trainer = nullptr;
+    Deserialize(filename, served->vocab, model, dynet_model, trainer);
+    delete trainer;
+    model.PrecomputeInputs();
+    served->native_model.reset(new NativeModel(model));
+  }
+  catch (...) {
+    ReleaseParameterMemory();
+    throw;
+  }
+  ReleaseParameterMemory();
+
+  if (quantize) {
+    served->native_model->Quantize();
+  }
+  return served;
+}
+
+// Polls the model file, and loads it again whenever it changes. Checkpoints
+// are renamed into place once fully written (see AsyncCheckpointer), so a
+// changed file is a complete one. A file that fails to load is not retried
+// until it changes again, and the old model stays in service meanwhile.
+void WatchModel(const string& filename, bool quantize, unsigned interval, FileVersion version, ModelHolder& holder) {
+  while (true) {
+    this_thread::sleep_for(chrono::seconds(interval));
+    FileVersion now;
+    if (!GetFileVersion(filename, now) || now == version) {
+      continue;
+    }
+    version = now;
+
+    try {
+      holder.Set(LoadModel(filename, quantize));
+      cerr << "Reloaded " << filename << "." << endl;
+    }
+    catch (const exception& e) {
+      cerr << "Unable to reload " << filename << ", keeping the current model: " << e.what() << endl;
+    }
+  }
+}
+
+// The state of one client: a decoder over whichever model was current at
+// its last request
+class Session {
+public:
+  explicit Session(ModelHolder& holder) : holder(holder) {}
+
+  // Answers one request line, without the trailing newline
+  string Handle(const string& line) {
+    shared_ptr<ServedModel> latest = holder.Get();
+    if (latest != model) {
+      decoder.reset(new NativeDecoder(*latest->native_model));
+      model = latest;
+    }
+
+    const size_t space = line.find(' ');
+    const string command = line.substr(0, space);
+    const string text = (space == string::npos) ? "" : line.substr(space + 1);
+    const bool per_token = (command == "TOKENS");
+    if (!per_token && command != "SCORE") {
+      return "ERROR Unknown command " + command;
+    }
+
+    vector<WordId> sentence;
+    try {
+      sentence = read_sentence(text, model->vocab);
+    }
+    catch (const exception& e) {
+      return string("ERROR ") + e.what();
+    }
+
+    // Out of vocabulary words are read as UNK, which the model itself may
+    // not know if the vocabulary only gained it after the model was built
+    for (WordId word : sentence) {
+      if ((unsigned)word >= model->native_model->VocabSize()) {
+        return "ERROR " + model->vocab.convert(word) + " is not in the model's vocabulary";
+      }
+    }
+
+    decoder->Reset();
+    unsigned p = 0;
+    double total = 0.0;
+    ostringstream tokens;
+    for (WordId word : sentence) {
+      if (decoder->IsDone(p) || !decoder->IsLegal(p, word)) {
+        return "ERROR " + model->vocab.convert(word) + " cannot follow the words before it";
+      }
+      const float log_prob = -decoder->Loss(p, word);
+      total += log_prob;
+      if (per_token) {
+        tokens << " " << log_prob;
+      }
+      p = decoder->AddInput(word, p);
+    }
+
+    ostringstream response;
+    response << total;
+    if (per_token) {
+      response << " |||" << tokens.str();
+    }
+    return response.str();
+  }
+
+private:
+  ModelHolder& holder;
+  // Declared before decoder, which refers to it, so that it outlives it
+  shared_ptr<ServedModel> model;
+  unique_ptr<NativeDecoder> decoder;
+};
+
+bool WriteAll(int fd, const string& data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t n = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    written += n;
+  }
+  return true;
+}
+
+void ServeConnection(int fd, ModelHolder& holder) {
+  FILE* in = fdopen(fd, "r");
+  if (in == nullptr) {
+    close(fd);
+    return;
+  }
+
+  Session session(holder);
+  char* buffer = nullptr;
+  size_t capacity = 0;
+  ssize_t length;
+  while ((length = getline(&buffer, &capacity, in)) != -1) {
+    string line(buffer, length);
+    while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
+      line.pop_back();
+    }
+    if (!WriteAll(fd, session.Handle(line) + "\n")) {
+      break;
+    }
+  }
+  free(buffer);
+  fclose(in);
+}
+
+int ServeSocket(const string& path, ModelHolder& holder) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    cerr << "Socket path " << path << " is too long." << endl;
+    return 1;
+  }
+  strcpy(address.sun_path, path.c_str());
+
+  // A socket left behind by an earlier server is replaced, but anything else
+  // at that path is most likely a mistyped --socket, and is left alone
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      cerr << path << " already exists and is not a socket." << endl;
+      return 1;
+    }
+    unlink(path.c_str());
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 64) != 0) {
+    cerr << "Unable to listen on " << path << ": " << strerror(errno) << endl;
+    return 1;
+  }
+  cerr << "Listening on " << path << "." << endl;
+
+  while (true) {
+    int client = accept(fd, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      cerr << "Unable to accept connections: " << strerror(errno) << endl;
+      return 1;
+    }
+    thread(ServeConnection, client, ref(holder)).detach();
+  }
+}
+
+int main(int argc, char** argv) {
+  dynet::initialize(argc, argv, true);
+
+  po::options_description desc("description");
+  desc.add_options()
+  ("help", "Display this help message")
+  ("model", po::value<string>()->required(), "Trained model")
+  ("socket", po::value<string>(), "Listen on this Unix domain socket instead of reading requests from stdin")
+  ("quantize", "Run the native inference engine with int8 weights")
+  ("reload_interval", po::value<unsigned>()->default_value(10), "Check this often, in seconds, whether the model file has changed, and reload it if so. 0 disables reloading");
+
+  po::positional_options_description positional_options;
+  positional_options.add("model", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(positional_options).run(), vm);
+
+  if (vm.count("help")) {
+    cerr << desc;
+    return 1;
+  }
+
+  po::notify(vm);
+
+  const string model_filename = vm["model"].as<string>();
+  const bool quantize = vm.count("quantize") > 0;
+  const unsigned reload_interval = vm["reload_interval"].as<unsigned>();
+
+  ModelHolder holder;
+  FileVersion version;
+  if (!GetFileVersion(model_filename, version)) {
+    cerr << "Unable to open " << model_filename << " for reading." << endl;
+    return 1;
+  }
+  try {
+    holder.Set(LoadModel(model_filename, quantize));
+  }
+  catch (const exception& e) {
+    cerr << "Unable to load " << model_filename << ": " << e.what() << endl;
+    return 1;
+  }
+
+  if (reload_interval > 0) {
+    thread(WatchModel, model_filename, quantize, reload_interval, version, ref(holder)).detach();
+  }
+
+  if (vm.count("socket")) {
+    return ServeSocket(vm["socket"].as<string>(), holder);
+  }
+
+  Session session(holder);
+  for (string line; getline(cin, line);) {
+    cout << session.Handle(line) << endl;
+  }
+  return 0;
+}
@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <cassert>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/archive/binary_oarchive.hpp>
+#include "shortlist.h"
+
+Shortlist::Shortlist() {}
+
+Shortlist::Shortlist(const vector<unsigned>& word_counts, unsigned size, const vector<unsigned>& always) {
+  vector<unsigned> words(word_counts.size());
+  for (unsigned i = 0; i < words.size(); ++i) {
+    words[i] = i;
+  }
+  size = min(size, (unsigned)words.size());
+  partial_sort(words.begin(), words.begin() + size, words.end(), [&](unsigned a, unsigned b) {
+    return word_counts[a] > word_counts[b] || (word_counts[a] == word_counts[b] && a < b);
+  });
+
+  is_common.assign(word_counts.size(), false);
+  for (unsigned i = 0; i < size; ++i) {
+    is_common[words[i]] = true;
+  }
+  for (unsigned w : always) {
+    is_common[w] = true;
+  }
+  for (unsigned w = 0; w < is_common.size(); ++w) {
+    if (is_common[w]) {
+      common_words.push_back(w);
+    }
+  }
+}
+
+void Shortlist::AddFollowers(const Corpus& text, unsigned follower_count) {
+  const unsigned vocab_size = is_common.size();
+  vector<unordered_map<unsigned, unsigned>> counts(vocab_size + 1);
+  for (unsigned i = 0; i < text.size(); ++i) {
+    WordId prev_word = -1;
+    for (WordId word : text[i]) {
+      // Words outside the shortlist's vocabulary are neither counted as
+      // followers nor given any
+      if ((unsigned)word < vocab_size && (prev_word == -1 || (unsigned)prev_word < vocab_size) && !is_common[word]) {
+        counts[prev_word + 1][word]++;
+      }
+      prev_word = word;
+    }
+  }
+
+  followers.assign(vocab_size + 1, vector<unsigned>());
+  for (unsigned i = 0; i < counts.size(); ++i) {
+    vector<pair<unsigned, unsigned>> ranked(counts[i].begin(), counts[i].end());
+    const unsigned n = min(follower_count, (unsigned)ranked.size());
+    partial_sort(ranked.begin(), ranked.begin() + n, ranked.end(), [](const pair<unsigned, unsigned>& a, const pair<unsigned, unsigned>& b) {
+      return a.second > b.second || (a.second == b.second && a.first < b.first);
+    });
+    for (unsigned j = 0; j < n; ++j) {
+      followers[i].push_back(ranked[j].first);
+    }
+  }
+}
+
+const vector<unsigned>& Shortlist::Followers(WordId prev_word) const {
+  static const vector<unsigned> none;
+  if (followers.size() == 0) {
+    return none;
+  }
+  assert (prev_word + 1 < (int)followers.size());
+  return followers[prev_word + 1];
+}
+
+void Shortlist::Words(WordId prev_word, vector<unsigned>& words) const {
+  const vector<unsigned>& extra = Followers(prev_word);
+  words.clear();
+  words.reserve(common_words.size() + extra.size());
+  words.insert(words.end(), common_words.begin(), common_words.end());
+  words.insert(words.end(), extra.begin(), extra.end());
+}
+
+bool Shortlist::Contains(WordId prev_word, unsigned word) const {
+  if (is_common[word]) {
+    return true;
+  }
+  const vector<unsigned>& extra = Followers(prev_word);
+  return find(extra.begin(), extra.end(), word) != extra.end();
+}
+
+unsigned Shortlist::CommonWordCount() const {
+  return common_words.size();
+}
+
+unsigned Shortlist::VocabSize() const {
+  return is_common.size();
+}
+
+void SaveShortlist(const string& filename, const Shortlist& shortlist) {
+  ofstream f(filename, ios::binary);
+  boost::archive::binary_oarchive oa(f);
+  oa & shortlist;
+}
+
+Shortlist LoadShortlist(const string& filename) {
+  ifstream f(filename, ios::binary);
+  if (!f.is_open()) {
+    cerr << "Unable to open " << filename << " for reading." << endl;
+    exit(1);
+  }
+  Shortlist shortlist;
+  boost::archive::binary_iarchive ia(f);
+  ia & shortlist;
+  return shortlist;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <boost/serialization/access.hpp>
+#include <boost/serialization/vector.hpp>
+#include "utils.h"
+
+using namespace std;
+
+// A subset of the vocabulary that the output layer can be restricted to at
+// inference time, so that only its rows of the output matrix are computed.
+// It always holds the most frequent words (and any others the caller asks
+// for, such as </LEFT> and </RIGHT>), plus, optionally, the words that most
+// often follow the previous word in some training text. Words outside the
+// shortlist get a probability of zero, and the words inside it are
+// renormalized among themselves.
+class Shortlist {
+public:
+  Shortlist();
+  // The size most frequent words according to word_counts, plus always
+  Shortlist(const vector<unsigned>& word_counts, unsigned size, const vector<unsigned>& always);
+
+  // Also allows, after each word, the follower_count words that most often
+  // follow it in text. Sentence starts count as a previous word of -1.
+  // Words of text beyond VocabSize() are ignored.
+  void AddFollowers(const Corpus& text, unsigned follower_count);
+
+  // Fills words with the ids of the shortlist after prev_word, without
+  // duplicates and in no particular order
+  void Words(WordId prev_word, vector<unsigned>& words) const;
+  // Whether word is in the shortlist after prev_word
+  bool Contains(WordId prev_word, unsigned word) const;
+  unsigned CommonWordCount() const;
+  unsigned VocabSize() const;
+
+private:
+  const vector<unsigned>& Followers(WordId prev_word) const;
+
+  vector<unsigned> common_words;
+  vector<bool> is_common;
+  // Followers of each word that are not already common. Entry 0 is for the
+  // start of a sentence, and entry w + 1 for word w.
+  vector<vector<unsigned>> followers;
+
+  friend class boost::serialization::access;
+  template<class Archive>
+  void serialize(Archive& ar, const unsigned int) {
+    ar & common_words;
+    ar & is_common;
+    ar & followers;
+  }
+};
+
+void SaveShortlist(const string& filename, const Shortlist& shortlist);
+// Exits with an error if the file cannot be read
+Shortlist LoadShortlist(const string& filename);
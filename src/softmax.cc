@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <cassert>
+#include "softmax.h"
+#include "utils.h"
+
+ClassFactoredSoftmax::ClassFactoredSoftmax() {}
+
+ClassFactoredSoftmax::ClassFactoredSoftmax(Model& model, unsigned hidden_size, const vector<unsigned>& word_counts, unsigned class_count, const vector<unsigned>& singletons) {
+  const unsigned vocab_size = word_counts.size();
+  assert (class_count > 0);
+
+  vector<bool> is_singleton(vocab_size, false);
+  for (unsigned w : singletons) {
+    assert (w < vocab_size);
+    is_singleton[w] = true;
+  }
+
+  // Sort the remaining words from most to least frequent
+  vector<unsigned> words;
+  double total_count = 0.0;
+  for (unsigned w = 0; w < vocab_size; ++w) {
+    if (!is_singleton[w]) {
+      words.push_back(w);
+      total_count += word_counts[w];
+    }
+  }
+  stable_sort(words.begin(), words.end(), [&](unsigned a, unsigned b) {
+    return word_counts[a] > word_counts[b];
+  });
+
+  // Fill each class until it holds its share of the total count. A class
+  // always gets at least one word, so frequent words end up in small classes
+  // and the long tail of rare words in large ones.
+  word_class.resize(vocab_size);
+  word_index.resize(vocab_size);
+  class_count = min(class_count, (unsigned)max(words.size(), (size_t)1));
+  double cumulative_count = 0.0;
+  for (unsigned i = 0; i < words.size(); ++i) {
+    unsigned w = words[i];
+    bool full = class_words.size() > 0 && cumulative_count >= total_count * class_words.size() / class_count;
+    if (class_words.size() == 0 || (full && class_words.size() < class_count)) {
+      class_words.push_back(vector<unsigned>());
+    }
+    word_class[w] = class_words.size() - 1;
+    word_index[w] = class_words.back().size();
+    class_words.back().push_back(w);
+    cumulative_count += word_counts[w];
+  }
+
+  for (unsigned w : singletons) {
+    word_class[w] = class_words.size();
+    word_index[w] = 0;
+    class_words.push_back(vector<unsigned>(1, w));
+  }
+
+  p_wHC = model.add_parameters({(unsigned)class_words.size(), hidden_size});
+  p_wCb = model.add_parameters({(unsigned)class_words.size()});
+}
+
+void ClassFactoredSoftmax::NewGraph(ComputationGraph& cg) {
+  wHC = parameter(cg, p_wHC);
+  wCb = parameter(cg, p_wCb);
+}
+
+Expression ClassFactoredSoftmax::Loss(const MLP& mlp, Expression hidden, unsigned word) const {
+  const unsigned c = word_class[word];
+  Expression class_scores = affine_transform({wCb, wHC, hidden});
+  Expression word_scores = mlp.Output(hidden, class_words[c]);
+  return pickneglogsoftmax(class_scores, c) + pickneglogsoftmax(word_scores, word_index[word]);
+}
+
+Expression ClassFactoredSoftmax::Loss(const MLP& mlp, Expression hidden, const vector<unsigned>& words) const {
+  if (words.size() == 1) {
+    return Loss(mlp, hidden, words[0]);
+  }
+
+  // The class predictions can be batched, but each batch element needs its
+  // own set of output rows for the word prediction.
+  vector<unsigned> classes(words.size());
+  vector<Expression> losses;
+  for (unsigned i = 0; i < words.size(); ++i) {
+    classes[i] = word_class[words[i]];
+    Expression word_scores = mlp.Output(pick_batch_elem(hidden, i), class_words[classes[i]]);
+    losses.push_back(pickneglogsoftmax(word_scores, word_index[words[i]]));
+  }
+  Expression class_scores = affine_transform({wCb, wHC, hidden});
+  losses.push_back(sum_batches(pickneglogsoftmax(class_scores, classes)));
+  return sum(losses);
+}
+
+Expression ClassFactoredSoftmax::LogDistribution(const MLP& mlp, Expression hidden) const {
+  Expression class_log_probs = log_softmax(affine_transform({wCb, wHC, hidden}));
+
+  // Build the distribution class by class, then put it back in vocabulary order
+  vector<Expression> parts(class_words.size());
+  vector<unsigned> class_offsets(class_words.size());
+  unsigned offset = 0;
+  for (unsigned c = 0; c < class_words.size(); ++c) {
+    parts[c] = log_softmax(mlp.Output(hidden, class_words[c])) + pick(class_log_probs, c);
+    class_offsets[c] = offset;
+    offset += class_words[c].size();
+  }
+
+  vector<unsigned> positions(word_class.size());
+  for (unsigned w = 0; w < word_class.size(); ++w) {
+    positions[w] = class_offsets[word_class[w]] + word_index[w];
+  }
+  return select_rows(concatenate(parts), positions);
+}
+
+pair<unsigned, float> ClassFactoredSoftmax::Sample(const MLP& mlp, Expression hidden, const vector<unsigned>& excluded) const {
+  vector<float> class_probs = as_vector(softmax(affine_transform({wCb, wHC, hidden})).value());
+  for (unsigned w : excluded) {
+    assert (class_words[word_class[w]].size() == 1);
+    class_probs[word_class[w]] = 0.0f;
+  }
+
+  float s = 0.0f;
+  for (float prob : class_probs) {
+    s += prob;
+  }
+  for (unsigned c = 0; c < class_probs.size(); ++c) {
+    class_probs[c] /= s;
+  }
+
+  unsigned c = ::Sample(class_probs);
+  vector<float> word_probs = as_vector(softmax(mlp.Output(hidden, class_words[c])).value());
+  unsigned i = ::Sample(word_probs);
+  return make_pair(class_words[c][i], log(class_probs[c]) + log(word_probs[i]));
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <boost/serialization/access.hpp>
+#include <boost/serialization/vector.hpp>
+#include "dynet/dynet.h"
+#include "dynet/expr.h"
+#include "mlp.h"
+
+using namespace std;
+using namespace dynet;
+using namespace dynet::expr;
+
+// A two-level output layer, which first predicts a word's class and then the
+// word given its class. Classes are built by binning the vocabulary by
+// frequency, so that each class covers about the same share of the training
+// text. The word scores are rows of an MLP's output layer, so predicting a
+// word only requires the rows of one class to be computed.
+class ClassFactoredSoftmax {
+public:
+  ClassFactoredSoftmax();
+  // Each of the words in singletons is put in a class of its own
+  ClassFactoredSoftmax(Model& model, unsigned hidden_size, const vector<unsigned>& word_counts, unsigned class_count, const vector<unsigned>& singletons);
+
+  void NewGraph(ComputationGraph& cg);
+
+  // hidden is the output of mlp's hidden layer
+  Expression Loss(const MLP& mlp, Expression hidden, unsigned word) const;
+  // Batched version of Loss. Returns the sum over the batch.
+  Expression Loss(const MLP& mlp, Expression hidden, const vector<unsigned>& words) const;
+  // Log probabilities of every word, in vocabulary order
+  Expression LogDistribution(const MLP& mlp, Expression hidden) const;
+  // Samples a word and returns it with its log probability, renormalized to
+  // account for the excluded words. Excluded words must be singletons.
+  pair<unsigned, float> Sample(const MLP& mlp, Expression hidden, const vector<unsigned>& excluded) const;
+
+private:
+  vector<unsigned> word_class;
+  vector<unsigned> word_index; // Position of each word within its class
+  vector<vector<unsigned>> class_words;
+
+  Parameter p_wHC;
+  Parameter p_wCb;
+
+  Expression wHC;
+  Expression wCb;
+
+  friend class NativeModel;
+  friend class boost::serialization::access;
+  template<class Archive>
+  void serialize(Archive& ar, const unsigned int) {
+    ar & word_class;
+    ar & word_index;
+    ar & class_words;
+    ar & p_wHC;
+    ar & p_wCb;
+  }
+};
@@ -1,6 +1,13 @@
 #include <iostream>
 #include <csignal>
 #include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "dynet/globals.h"
 #include "train.h"
 #include "deplm.h"
 #include "utils.h"
@@ -12,38 +19,124 @@ using namespace dynet::mp;
 using namespace std;
 namespace po = boost::program_options;
 
-class Learner : public ILearner<OutputSentence, SufficientStats> {
+typedef std::chrono::steady_clock Clock;
+
+// Returns the number of seconds since t, and resets t to now
+double Lap(Clock::time_point& t) {
+  Clock::time_point now = Clock::now();
+  double secs = std::chrono::duration_cast<std::chrono::microseconds>(now - t).count() / 1000000.0;
+  t = now;
+  return secs;
+}
+
+// Where the time went during one reporting interval of training, and how
+// big the computation graphs were. Dev set runs are not included.
+struct TrainingMetrics {
+  double build_secs;
+  double forward_secs;
+  double backward_secs;
+  double update_secs;
+  double dev_secs; // Dev set evaluation and model saving
+  unsigned long node_count;
+  size_t peak_graph_bytes; // Largest total size of all node values in one graph
+
+  TrainingMetrics() : build_secs(), forward_secs(), backward_secs(), update_secs(), dev_secs(), node_count(), peak_graph_bytes() {}
+};
+
+// Returns the peak resident set size of this process, in kilobytes
+long MaxRSS() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+class Learner : public ILearner<SentenceView, SufficientStats> {
 public:
   Learner(Dict& vocab, DependencyOutputModel& model, Model& dynet_model, Trainer* trainer) : vocab(vocab), model(model), dynet_model(dynet_model), trainer(trainer) {}
   ~Learner() {}
-  SufficientStats LearnFromDatum(const OutputSentence& datum, bool learn) {
+  SufficientStats LearnFromDatum(const SentenceView& datum, bool learn) {
     ComputationGraph cg;
     model.NewGraph(cg);
 
     if (learn) {
       model.SetDropout(dropout_rate);
+      model.SetLossSampler(loss_sampler, loss_sample_count);
     }
     else {
       model.SetDropout(0.0f);
+      model.SetLossSampler(nullptr, 0);
     }
 
+    Clock::time_point t = Clock::now();
     Expression loss_expr = model.BuildGraph(datum);
-    dynet::real loss = as_scalar(cg.forward(loss_expr));
-    if (learn) {
-      cg.backward(loss_expr);
+    return Run(cg, loss_expr, t, learn, SufficientStats(0.0, datum.size(), 1));
+  }
+
+  SufficientStats LearnFromBatch(const vector<SentenceView>& batch, bool learn) {
+    if (batch.size() == 1) {
+      return LearnFromDatum(batch[0], learn);
     }
-    return SufficientStats(loss, datum.size(), 1);
+
+    ComputationGraph cg;
+    model.NewGraph(cg);
+    model.SetDropout(learn ? dropout_rate : 0.0f);
+    model.SetLossSampler(learn ? loss_sampler : nullptr, loss_sample_count);
+
+    Clock::time_point t = Clock::now();
+    Expression loss_expr = model.BuildGraph(batch);
+
+    unsigned word_count = 0;
+    for (const SentenceView& sentence : batch) {
+      word_count += sentence.size();
+    }
+    return Run(cg, loss_expr, t, learn, SufficientStats(0.0, word_count, batch.size()));
   }
 
   void SaveModel() {
-    if (!quiet) {
+    if (quiet) {
+      return;
+    }
+
+    if (checkpointer != nullptr) {
+      checkpointer->Save(vocab, model, dynet_model, trainer);
+    }
+    else {
       Serialize(vocab, model, dynet_model, trainer);
     }
   }
 
   bool quiet;
   float dropout_rate;
+  TrainingMetrics metrics;
+  AsyncCheckpointer* checkpointer;
+  // If not null, train with a sampled softmax instead of the full one
+  const AliasSampler* loss_sampler;
+  unsigned loss_sample_count;
 private:
+  // Runs the forward (and, if learning, backward) pass over a graph whose
+  // construction began at time t, and fills in the loss of stats
+  SufficientStats Run(ComputationGraph& cg, Expression& loss_expr, Clock::time_point& t, bool learn, SufficientStats stats) {
+    double build_secs = Lap(t);
+    stats.loss = as_scalar(cg.forward(loss_expr));
+    double forward_secs = Lap(t);
+    if (!learn) {
+      return stats;
+    }
+
+    cg.backward(loss_expr);
+    metrics.build_secs += build_secs;
+    metrics.forward_secs += forward_secs;
+    metrics.backward_secs += Lap(t);
+
+    size_t graph_bytes = 0;
+    for (const Node* node : cg.nodes) {
+      graph_bytes += node->dim.size() * sizeof(dynet::real);
+    }
+    metrics.node_count += cg.nodes.size();
+    metrics.peak_graph_bytes = max(metrics.peak_graph_bytes, graph_bytes);
+    return stats;
+  }
+
   Dict& vocab;
   DependencyOutputModel& model;
   Model& dynet_model;
@@ -67,14 +160,235 @@ void ctrlc_handler(int signal) {
   }
 }
 
-SufficientStats RunDevSet(vector<OutputSentence>& dev_set, Learner* learner) {
+// Reads or writes exactly size bytes, retrying after partial transfers.
+bool ReadAll(int fd, void* buffer, size_t size) {
+  char* p = (char*)buffer;
+  while (size > 0) {
+    ssize_t r = read(fd, p, size);
+    if (r <= 0) {
+      return false;
+    }
+    p += r;
+    size -= r;
+  }
+  return true;
+}
+
+bool WriteAll(int fd, const void* buffer, size_t size) {
+  const char* p = (const char*)buffer;
+  while (size > 0) {
+    ssize_t r = write(fd, p, size);
+    if (r <= 0) {
+      return false;
+    }
+    p += r;
+    size -= r;
+  }
+  return true;
+}
+
+// Runs the dev set forward only (no dropout, no backward pass).
+// With more than one core, the dev set is split into contiguous shards which
+// are scored by forked worker processes. Each worker sends back the stats of
+// every sentence it scored once its whole shard is done, and the parent adds
+// them up in the original order, so the result is identical to that of
+// scoring the dev set serially.
+SufficientStats RunDevSet(const Corpus& dev_set, Learner* learner, unsigned num_cores) {
+  num_cores = min(num_cores, (unsigned)dev_set.size());
+  vector<SufficientStats> sentence_stats(dev_set.size());
+
+  if (num_cores <= 1) {
+    for (unsigned i = 0; i < dev_set.size(); ++i) {
+      sentence_stats[i] = learner->LearnFromDatum(dev_set[i], false);
+    }
+  }
+  else {
+    cout.flush();
+    cerr.flush();
+
+    vector<pid_t> workers;
+    vector<int> pipes;
+    vector<pair<unsigned, unsigned>> shards;
+    for (unsigned w = 0; w < num_cores; ++w) {
+      unsigned begin = (unsigned)((size_t)dev_set.size() * w / num_cores);
+      unsigned end = (unsigned)((size_t)dev_set.size() * (w + 1) / num_cores);
+
+      int fds[2];
+      if (pipe(fds) != 0) {
+        cerr << "Unable to create pipe for dev set worker." << endl;
+        exit(1);
+      }
+
+      pid_t pid = fork();
+      if (pid == -1) {
+        cerr << "Unable to fork dev set worker." << endl;
+        exit(1);
+      }
+      else if (pid == 0) {
+        close(fds[0]);
+        // Buffer the whole shard and write it once at the end, so that a
+        // worker finishes scoring before it can fill the pipe. The write
+        // itself may still block until the parent gets to this worker's
+        // pipe, but by then there is nothing left to compute.
+        vector<SufficientStats> shard_stats(end - begin);
+        for (unsigned i = begin; i < end; ++i) {
+          shard_stats[i - begin] = learner->LearnFromDatum(dev_set[i], false);
+        }
+        if (!WriteAll(fds[1], shard_stats.data(), sizeof(SufficientStats) * shard_stats.size())) {
+          _exit(1);
+        }
+        close(fds[1]);
+        _exit(0);
+      }
+
+      close(fds[1]);
+      workers.push_back(pid);
+      pipes.push_back(fds[0]);
+      shards.push_back(make_pair(begin, end));
+    }
+
+    bool ok = true;
+    for (unsigned w = 0; w < workers.size(); ++w) {
+      unsigned begin = shards[w].first;
+      unsigned end = shards[w].second;
+      ok = ReadAll(pipes[w], &sentence_stats[begin], sizeof(SufficientStats) * (end - begin)) && ok;
+      close(pipes[w]);
+
+      int status;
+      waitpid(workers[w], &status, 0);
+      ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+    if (!ok) {
+      cerr << "A dev set worker failed." << endl;
+      exit(1);
+    }
+  }
+
   SufficientStats r;
   for (unsigned i = 0; i < dev_set.size(); ++i) {
-    r += learner->LearnFromDatum(dev_set[i], false);
+    r += sentence_stats[i];
   }
   return r;
 }
 
+// Scores a batch of two copies of sentence, which form a single group with
+// the same tree shape, and checks that it costs exactly twice as much as the
+// sentence on its own. This exercises every batched path of the chosen
+// objective before training starts, rather than partway into the first
+// epoch. With a sampled softmax the two losses are not comparable, so the
+// batch only has to build and run.
+void CheckBatching(DependencyOutputModel& model, const SentenceView& sentence, const AliasSampler* loss_sampler, unsigned loss_sample_count) {
+  const vector<SentenceView> batch(2, sentence);
+  model.SetDropout(0.0f);
+  model.SetLossSampler(nullptr, 0);
+
+  float single_loss;
+  {
+    ComputationGraph cg;
+    model.NewGraph(cg);
+    single_loss = as_scalar(cg.forward(model.BuildGraph(sentence)));
+  }
+
+  float batch_loss;
+  {
+    ComputationGraph cg;
+    model.NewGraph(cg);
+    batch_loss = as_scalar(cg.forward(model.BuildGraph(batch)));
+  }
+
+  if (fabs(batch_loss - 2 * single_loss) > 1.0e-3f * (1.0f + fabs(batch_loss))) {
+    cerr << "Batched training is broken: a batch of two copies of a sentence has loss " << batch_loss << ", but the sentence alone has loss " << single_loss << "." << endl;
+    exit(1);
+  }
+
+  if (loss_sampler != nullptr) {
+    ComputationGraph cg;
+    model.NewGraph(cg);
+    model.SetLossSampler(loss_sampler, loss_sample_count);
+    cg.forward(model.BuildGraph(batch));
+    model.SetLossSampler(nullptr, 0);
+  }
+}
+
+// Splits the training set into minibatches of at most batch_size sentences.
+// Sentences are sorted by length and then by their sequence of </LEFT> and
+// </RIGHT> actions, so that each batch contains as many sentences with
+// identical tree shapes as possible.
+vector<vector<unsigned>> MakeBatches(const Corpus& text, unsigned batch_size, Dict& vocab) {
+  const WordId done_with_left = vocab.convert("</LEFT>");
+  const WordId done_with_right = vocab.convert("</RIGHT>");
+
+  vector<string> patterns(text.size());
+  for (unsigned i = 0; i < text.size(); ++i) {
+    patterns[i].resize(text[i].size());
+    for (unsigned j = 0; j < text[i].size(); ++j) {
+      WordId id = text[i][j];
+      patterns[i][j] = (id == done_with_left) ? 'L' : (id == done_with_right) ? 'R' : 'w';
+    }
+  }
+
+  vector<unsigned> order(text.size());
+  for (unsigned i = 0; i < text.size(); ++i) {
+    order[i] = i;
+  }
+
+  if (batch_size > 1) {
+    stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+      if (patterns[a].size() != patterns[b].size()) {
+        return patterns[a].size() < patterns[b].size();
+      }
+      return patterns[a] < patterns[b];
+    });
+  }
+
+  vector<vector<unsigned>> batches;
+  for (unsigned i = 0; i < order.size(); i += batch_size) {
+    unsigned end = min(i + batch_size, (unsigned)order.size());
+    batches.push_back(vector<unsigned>(order.begin() + i, order.begin() + end));
+  }
+  return batches;
+}
+
+// Writes the throughput and time breakdown of one reporting interval to
+// stderr, and as one line of JSON to metrics_file if it is open. Time not
+// spent in any of the measured phases (reading and batching data, etc.)
+// is reported as "other".
+void ReportMetrics(float fractional_epoch, const SufficientStats& stats, double secs, const TrainingMetrics& metrics, ofstream& metrics_file) {
+  double train_secs = max(secs - metrics.dev_secs, 1e-6);
+  double other_secs = max(train_secs - metrics.build_secs - metrics.forward_secs - metrics.backward_secs - metrics.update_secs, 0.0);
+  double words_per_sec = stats.word_count / train_secs;
+  double sentences_per_sec = stats.sentence_count / train_secs;
+  double nodes_per_sentence = stats.sentence_count > 0 ? 1.0 * metrics.node_count / stats.sentence_count : 0.0;
+  long max_rss = MaxRSS();
+
+  cerr << fractional_epoch << "\t" << words_per_sec << " words/sec, " << sentences_per_sec << " sents/sec"
+       << " (build " << metrics.build_secs << ", forward " << metrics.forward_secs
+       << ", backward " << metrics.backward_secs << ", update " << metrics.update_secs
+       << ", other " << other_secs << ", dev " << metrics.dev_secs << " secs) "
+       << nodes_per_sentence << " nodes/sent, " << metrics.peak_graph_bytes / 1024 << " KB peak graph, "
+       << max_rss / 1024 << " MB max RSS" << endl;
+
+  if (metrics_file.is_open()) {
+    metrics_file << "{\"epoch\": " << fractional_epoch
+                 << ", \"loss\": " << stats.loss
+                 << ", \"words\": " << stats.word_count
+                 << ", \"sentences\": " << stats.sentence_count
+                 << ", \"secs\": " << secs
+                 << ", \"words_per_sec\": " << words_per_sec
+                 << ", \"sentences_per_sec\": " << sentences_per_sec
+                 << ", \"build_secs\": " << metrics.build_secs
+                 << ", \"forward_secs\": " << metrics.forward_secs
+                 << ", \"backward_secs\": " << metrics.backward_secs
+                 << ", \"update_secs\": " << metrics.update_secs
+                 << ", \"other_secs\": " << other_secs
+                 << ", \"dev_secs\": " << metrics.dev_secs
+                 << ", \"nodes_per_sentence\": " << nodes_per_sentence
+                 << ", \"peak_graph_bytes\": " << metrics.peak_graph_bytes
+                 << ", \"max_rss_kb\": " << max_rss << "}" << endl;
+  }
+}
+
 int main(int argc, char** argv) {
   signal (SIGINT, ctrlc_handler);
   cerr << "Invoked as:";
@@ -93,10 +407,21 @@ int main(int argc, char** argv) {
   ("hidden_dim,h", po::value<unsigned>()->default_value(64), "Size of hidden layers")
   ("num_iterations,i", po::value<unsigned>()->default_value(UINT_MAX), "Number of epochs to train for")
   ("cores,j", po::value<unsigned>()->default_value(1), "Number of CPU cores to use for training")
+  ("dev_cores", po::value<unsigned>()->default_value(1), "Number of processes to use for dev set evaluation when training on a single core")
+  ("stream", "Stream the training text from disk instead of loading it into memory")
+  ("shuffle_buffer", po::value<unsigned>()->default_value(100000), "Number of sentences to hold in memory for shuffling when streaming the training text")
+  ("batch_size,b", po::value<unsigned>()->default_value(1), "Number of sentences per minibatch. Sentences are bucketed by length and tree shape")
+  ("update_every", po::value<unsigned>()->default_value(1), "Accumulate gradients over this many minibatches before each parameter update")
   ("dropout_rate", po::value<float>()->default_value(0.0), "Dropout rate (should be >= 0.0 and < 1)")
+  ("sampled_softmax", po::value<unsigned>()->default_value(0), "Train with a sampled softmax using this many negative samples per sentence, drawn from the unigram distribution of the training text. 0 means use the full softmax")
+  ("sampling_power", po::value<float>()->default_value(1.0f), "Raise unigram counts to this power before drawing negative samples")
+  ("class_factored_softmax", po::value<unsigned>()->default_value(0), "When training a new model, factor the output softmax into this many frequency-binned word classes. 0 means use the full softmax")
+  ("tie_embeddings", "When training a new model, use the input word embeddings as the output layer's weights too")
   ("report_frequency,r", po::value<unsigned>()->default_value(100), "Show the training loss of every r examples")
   ("dev_frequency,d", po::value<unsigned>()->default_value(10000), "Run the dev set every d examples. Save the model if the score is a new best")
   ("quiet,q", "Do not output model")
+  ("metrics_file", po::value<string>(), "Also append the throughput and timing metrics of each report to this file, one JSON object per line")
+  ("checkpoint", po::value<string>(), "Save the best model to this file in the background, instead of writing it to stdout")
   ("model", po::value<string>(), "Reload this model and continue learning");
 
   AddTrainerOptions(desc);
@@ -117,6 +442,12 @@ int main(int argc, char** argv) {
  
   const unsigned num_cores = vm["cores"].as<unsigned>();  
   const unsigned num_iterations = vm["num_iterations"].as<unsigned>();
+  const unsigned batch_size = vm["batch_size"].as<unsigned>();
+  const unsigned dev_cores = vm["dev_cores"].as<unsigned>();
+  const unsigned update_every = vm["update_every"].as<unsigned>();
+  const bool streaming = vm.count("stream") > 0;
+  const unsigned loss_sample_count = vm["sampled_softmax"].as<unsigned>();
+  const unsigned class_count = vm["class_factored_softmax"].as<unsigned>();
   const string train_text_filename = vm["train_text"].as<string>();
   const string dev_text_filename = vm["dev_text"].as<string>();
 
@@ -136,17 +467,44 @@ int main(int argc, char** argv) {
     }
   }
 
-  vector<OutputSentence> train_text = ReadText(train_text_filename, vocab);
+  if (loss_sample_count > 0 && class_count > 0) {
+    cerr << "Invalid parameters: --sampled_softmax and --class_factored_softmax cannot be used together." << endl;
+    return 1;
+  }
+
+  if (streaming && IsCorpusCache(train_text_filename)) {
+    cerr << "Invalid parameters: " << train_text_filename << " is a corpus cache, which is memory-mapped rather than loaded, so --stream is unnecessary." << endl;
+    return 1;
+  }
+
+  // When streaming, only the vocabulary and sentence count are read up front
+  Corpus train_text;
+  unsigned train_sentence_count;
+  vector<unsigned> word_counts;
+  if (streaming) {
+    train_sentence_count = ReadVocabulary(train_text_filename, vocab, &word_counts);
+  }
+  else {
+    train_text = ReadCorpus(train_text_filename, vocab);
+    train_sentence_count = train_text.size();
+    if (loss_sample_count > 0 || class_count > 0) {
+      word_counts = CountWords(train_text, vocab.size());
+    }
+  }
+  word_counts.resize(vocab.size());
 
   if (!vm.count("model")) {
     unsigned hidden_dim = vm["hidden_dim"].as<unsigned>();
     Embedder* embedder = new StandardEmbedder(dynet_model, vocab.size(), hidden_dim);
-    model = new DependencyOutputModel(dynet_model, embedder, hidden_dim, hidden_dim, vocab);
+    model = new DependencyOutputModel(dynet_model, embedder, hidden_dim, hidden_dim, vocab, vm.count("tie_embeddings") > 0);
+    if (class_count > 0) {
+      model->UseClassFactoredSoftmax(dynet_model, word_counts, class_count);
+    }
     vocab.freeze();
     vocab.set_unk("UNK");
   }
 
-  vector<OutputSentence> dev_text = ReadText(dev_text_filename, vocab);
+  Corpus dev_text = ReadCorpus(dev_text_filename, vocab);
 
   cerr << "Vocabulary size: " << vocab.size() << endl;
   cerr << "Total parameters: " << dynet_model.parameter_count() << endl;
@@ -156,45 +514,169 @@ int main(int argc, char** argv) {
   learner.quiet = vm.count("quiet") > 0;
   learner.dropout_rate = vm["dropout_rate"].as<float>();
 
-  const bool quiet = vm.count("quiet") > 0;
+  unique_ptr<AsyncCheckpointer> checkpointer;
+  if (vm.count("checkpoint")) {
+    checkpointer.reset(new AsyncCheckpointer(vm["checkpoint"].as<string>()));
+  }
+  learner.checkpointer = checkpointer.get();
+
+  // Negative samples are drawn from the (smoothed) unigram distribution
+  unique_ptr<AliasSampler> loss_sampler;
+  if (loss_sample_count > 0) {
+    const float power = vm["sampling_power"].as<float>();
+    vector<float> weights(vocab.size());
+    for (unsigned i = 0; i < vocab.size(); ++i) {
+      weights[i] = pow(word_counts[i] + 1.0f, power);
+    }
+    loss_sampler.reset(new AliasSampler(weights));
+  }
+  learner.loss_sampler = loss_sampler.get();
+  learner.loss_sample_count = loss_sample_count;
+
   const unsigned dev_frequency = vm["dev_frequency"].as<unsigned>();
-  const unsigned report_frequency = vm["report_frequency"].as<unsigned>(); 
+  const unsigned report_frequency = vm["report_frequency"].as<unsigned>();
+
+  // With more than one core, hand training off to dynet's multi-process
+  // trainer. The model parameters live in shared memory (see the call to
+  // dynet::initialize above), so each child process updates them in place
+  // without locking, Hogwild style. Worker processes are used rather than
+  // threads because dynet only supports one live ComputationGraph at a time.
+  // Reporting, dev set evaluation, and saving the best model via
+  // Learner::SaveModel() are all handled by the parent process.
+  if (num_cores > 1) {
+    if (batch_size > 1 || streaming) {
+      cerr << "Invalid parameters: Minibatching and streaming are not supported with multiple cores." << endl;
+      return 1;
+    }
+    if (vm.count("metrics_file") || update_every > 1) {
+      cerr << "Invalid parameters: --metrics_file and --update_every are not supported with multiple cores." << endl;
+      return 1;
+    }
+    run_multi_process<SentenceView, SufficientStats>(num_cores, &learner, trainer, train_text.sentences(), dev_text.sentences(), num_iterations, dev_frequency, report_frequency);
+    return 0;
+  }
+
+  if (update_every == 0) {
+    cerr << "Invalid parameters: --update_every must be at least 1." << endl;
+    return 1;
+  }
+
+  if (batch_size > 1) {
+    if (!streaming && train_text.size() > 0) {
+      CheckBatching(*model, train_text[0], loss_sampler.get(), loss_sample_count);
+    }
+    else if (dev_text.size() > 0) {
+      CheckBatching(*model, dev_text[0], loss_sampler.get(), loss_sample_count);
+    }
+  }
 
   unsigned data_since_dev = 0;
   unsigned data_since_report = 0;
+  unsigned batches_since_update = 0;
   SufficientStats loss;
   SufficientStats best_dev_stats;
-  std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+  Clock::time_point start_time = Clock::now();
+
+  ofstream metrics_file;
+  if (vm.count("metrics_file")) {
+    metrics_file.open(vm["metrics_file"].as<string>(), ios::app);
+    if (!metrics_file.is_open()) {
+      cerr << "Unable to open metrics file " << vm["metrics_file"].as<string>() << endl;
+      return 1;
+    }
+  }
+
+  // In memory, the training text is bucketed into minibatches up front.
+  // When streaming, each minibatch is simply the next batch_size sentences
+  // to come out of the shuffle buffer.
+  vector<vector<unsigned>> batches;
+  unique_ptr<StreamingText> train_stream;
+  vector<vector<WordId>> stream_batch;
+  if (streaming) {
+    train_stream.reset(new StreamingText(train_text_filename, vocab, vm["shuffle_buffer"].as<unsigned>()));
+  }
+  else {
+    batches = MakeBatches(train_text, batch_size, vocab);
+  }
 
   for (unsigned iteration = 0; iteration < num_iterations; ++iteration) {
-    for (unsigned i = 0; i < train_text.size(); ++i) {
-      const OutputSentence& sentence = train_text[i];
-      loss += learner.LearnFromDatum(sentence, true);
-
-      float fractional_epoch = iteration + 1.0f * (i + 1) / train_text.size();
-      if (++data_since_report == report_frequency) {
-        std::chrono::steady_clock::time_point end_time = std::chrono::steady_clock::now();
-        double secs = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count() / 1000000.0;
-        start_time = end_time;
+    if (streaming) {
+      if (iteration > 0) {
+        train_stream->Reset();
+      }
+    }
+    else if (batch_size > 1) {
+      shuffle(batches.begin(), batches.end(), *dynet::rndeng);
+    }
+
+    unsigned sentences_seen = 0;
+    for (unsigned i = 0; ; ++i) {
+      vector<SentenceView> batch;
+      if (streaming) {
+        stream_batch.resize(batch_size);
+        for (unsigned j = 0; j < batch_size && train_stream->Next(stream_batch[j]); ++j) {
+          batch.push_back(SentenceView(stream_batch[j]));
+        }
+      }
+      else if (i < batches.size()) {
+        for (unsigned j = 0; j < batches[i].size(); ++j) {
+          batch.push_back(train_text[batches[i][j]]);
+        }
+      }
+
+      if (batch.size() == 0) {
+        break;
+      }
+
+      loss += learner.LearnFromBatch(batch, true);
+      sentences_seen += batch.size();
+
+      // dynet adds up the gradients of every backward pass until the next
+      // update, so skipping updates accumulates gradients across minibatches
+      if (++batches_since_update >= update_every) {
+        Clock::time_point update_start = Clock::now();
+        trainer->update();
+        learner.metrics.update_secs += Lap(update_start);
+        batches_since_update = 0;
+      }
+
+      float fractional_epoch = iteration + 1.0f * sentences_seen / train_sentence_count;
+      data_since_report += batch.size();
+      if (data_since_report >= report_frequency) {
+        double secs = Lap(start_time);
         cerr << fractional_epoch << "\t" << "loss = " << loss << " (" << secs << " secs)" << endl;
+        ReportMetrics(fractional_epoch, loss, secs, learner.metrics, metrics_file);
         data_since_report = 0;
         loss = SufficientStats();
+        learner.metrics = TrainingMetrics();
       }
-      trainer->update();
 
-      if (++data_since_dev == dev_frequency) {
-        SufficientStats dev_stats = RunDevSet(dev_text, &learner);
+      // Dev evaluation and saving wait until the pending gradients have been
+      // applied, so they always see a model that has learned from every
+      // sentence counted so far
+      data_since_dev += batch.size();
+      if (data_since_dev >= dev_frequency && batches_since_update == 0) {
+        Clock::time_point dev_start = Clock::now();
+        SufficientStats dev_stats = RunDevSet(dev_text, &learner, dev_cores);
         bool new_best = (best_dev_stats.sentence_count == 0) || (dev_stats < best_dev_stats);
         cerr << fractional_epoch << "\t" << "dev loss = " << dev_stats << (new_best ? " (New best!)" : "") << endl;
         if (new_best) {
-          if (!quiet) {
-            Serialize(vocab, *model, dynet_model, trainer);
-          }
+          learner.SaveModel();
           best_dev_stats = dev_stats;
         }
         data_since_dev = 0;
+        learner.metrics.dev_secs += Lap(dev_start);
       }
     }
+
+    // An epoch whose batch count is not a multiple of update_every leaves
+    // gradients behind, which would otherwise be lost after the last epoch
+    if (batches_since_update > 0) {
+      Clock::time_point update_start = Clock::now();
+      trainer->update();
+      learner.metrics.update_secs += Lap(update_start);
+      batches_since_update = 0;
+    }
   }
 
   return 0;
@@ -5,9 +5,16 @@
 #include <map>
 #include <cassert>
 #include <cctype>
+#include <random>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/regex.hpp>
+#include "dynet/globals.h"
 #include "utils.h"
 
 using namespace std;
@@ -15,6 +22,62 @@ using namespace std;
 Word::~Word() {}
 StandardWord::StandardWord(WordId id) : id(id) {}
 
+SentenceView::SentenceView() : words(nullptr), length(0) {}
+SentenceView::SentenceView(const WordId* words, unsigned length) : words(words), length(length) {}
+SentenceView::SentenceView(const vector<WordId>& words) : words(words.data()), length(words.size()) {}
+
+struct Corpus::Mapping {
+  Mapping(void* base, size_t length) : base(base), length(length), words(nullptr), offsets(nullptr), sentence_count(0), word_count(0) {}
+  ~Mapping() {
+    munmap(base, length);
+  }
+
+  void* base;
+  size_t length;
+  const WordId* words;
+  const uint64_t* offsets;
+  unsigned sentence_count;
+  size_t word_count;
+};
+
+Corpus::Corpus() : offsets(1, 0) {}
+
+void Corpus::AddSentence(const vector<WordId>& sentence) {
+  assert (mapping == nullptr);
+  words.insert(words.end(), sentence.begin(), sentence.end());
+  offsets.push_back(words.size());
+}
+
+unsigned Corpus::size() const {
+  return (mapping != nullptr) ? mapping->sentence_count : offsets.size() - 1;
+}
+
+size_t Corpus::word_count() const {
+  return (mapping != nullptr) ? mapping->word_count : words.size();
+}
+
+const WordId* Corpus::word_data() const {
+  return (mapping != nullptr) ? mapping->words : words.data();
+}
+
+const uint64_t* Corpus::offset_data() const {
+  return (mapping != nullptr) ? mapping->offsets : offsets.data();
+}
+
+SentenceView Corpus::operator[](unsigned i) const {
+  assert (i < size());
+  const uint64_t* o = offset_data();
+  return SentenceView(word_data() + o[i], o[i + 1] - o[i]);
+}
+
+vector<SentenceView> Corpus::sentences() const {
+  vector<SentenceView> r(size());
+  for (unsigned i = 0; i < size(); ++i) {
+    r[i] = (*this)[i];
+  }
+  return r;
+}
+
 // Samples an item from a multinomial distribution
 // The values in dist should sum to one.
 unsigned Sample(const vector<float>& dist) {
@@ -33,6 +96,72 @@ unsigned Sample(const vector<float>& dist) {
   return w;
 }
 
+AliasSampler::AliasSampler() {}
+
+AliasSampler::AliasSampler(const vector<float>& weights) {
+  const unsigned n = weights.size();
+  assert (n > 0);
+
+  double total = 0.0;
+  for (float w : weights) {
+    assert (w >= 0.0f);
+    total += w;
+  }
+  assert (total > 0.0);
+
+  probabilities.resize(n);
+  thresholds.resize(n);
+  aliases.resize(n);
+
+  // Scale each probability by n, then repeatedly pair an underfull bucket
+  // with an overfull one until every bucket holds exactly 1/n of the mass.
+  vector<double> scaled(n);
+  vector<unsigned> small, large;
+  for (unsigned i = 0; i < n; ++i) {
+    probabilities[i] = weights[i] / total;
+    scaled[i] = n * (weights[i] / total);
+    aliases[i] = i;
+    (scaled[i] < 1.0 ? small : large).push_back(i);
+  }
+
+  while (small.size() > 0 && large.size() > 0) {
+    unsigned s = small.back();
+    small.pop_back();
+    unsigned l = large.back();
+    large.pop_back();
+
+    thresholds[s] = scaled[s];
+    aliases[s] = l;
+    scaled[l] -= 1.0 - scaled[s];
+    (scaled[l] < 1.0 ? small : large).push_back(l);
+  }
+
+  // Anything left over is full up to rounding error
+  for (unsigned i : small) {
+    thresholds[i] = 1.0f;
+  }
+  for (unsigned i : large) {
+    thresholds[i] = 1.0f;
+  }
+}
+
+unsigned AliasSampler::Draw() const {
+  double r = rand01() * thresholds.size();
+  unsigned i = (unsigned)r;
+  if (i >= thresholds.size()) {
+    i = thresholds.size() - 1;
+  }
+  return (r - i < thresholds[i]) ? i : aliases[i];
+}
+
+float AliasSampler::Probability(unsigned i) const {
+  return probabilities[i];
+}
+
+unsigned AliasSampler::size() const {
+  return probabilities.size();
+}
+
 // given the first character of a UTF8 block, find out how wide it is
 // see http://en.wikipedia.org/wiki/UTF-8 for more info
 unsigned int UTF8Len(unsigned char x) {
@@ -168,3 +297,234 @@ vector<OutputSentence> ReadText(const string& filename, Dict& vocab) {
   return r;
 }
 
+Corpus ReadCorpus(const string& filename, Dict& vocab) {
+  if (IsCorpusCache(filename)) {
+    return MapCorpusCache(filename, vocab);
+  }
+
+  ifstream f(filename);
+  if (!f.is_open()) {
+    cerr << "Unable to open " << filename << " for reading." << endl;
+    exit(1);
+  }
+
+  Corpus r;
+  for (string line; getline(f, line);) {
+    r.AddSentence(read_sentence(line, vocab));
+  }
+
+  return r;
+}
+
+unsigned ReadVocabulary(const string& filename, Dict& vocab, vector<unsigned>* counts) {
+  ifstream f(filename);
+  if (!f.is_open()) {
+    cerr << "Unable to open " << filename << " for reading." << endl;
+    exit(1);
+  }
+
+  unsigned sentence_count = 0;
+  for (string line; getline(f, line);) {
+    vector<WordId> sentence = read_sentence(line, vocab);
+    if (counts != nullptr) {
+      for (WordId word : sentence) {
+        if ((unsigned)word >= counts->size()) {
+          counts->resize(word + 1);
+        }
+        (*counts)[word]++;
+      }
+    }
+    ++sentence_count;
+  }
+  return sentence_count;
+}
+
+vector<unsigned> CountWords(const Corpus& corpus, unsigned vocab_size) {
+  vector<unsigned> counts(vocab_size);
+  const WordId* words = corpus.word_data();
+  for (size_t i = 0; i < corpus.word_count(); ++i) {
+    assert ((unsigned)words[i] < vocab_size);
+    counts[words[i]]++;
+  }
+  return counts;
+}
+
+StreamingText::StreamingText(const string& filename, Dict& vocab, unsigned buffer_size) : filename(filename), vocab(vocab), buffer_size(buffer_size) {
+  assert (buffer_size > 0);
+  Reset();
+}
+
+void StreamingText::Reset() {
+  f.close();
+  f.clear();
+  f.open(filename);
+  if (!f.is_open()) {
+    cerr << "Unable to open " << filename << " for reading." << endl;
+    exit(1);
+  }
+  buffer.clear();
+}
+
+bool StreamingText::Next(vector<WordId>& sentence) {
+  string line;
+  while (buffer.size() < buffer_size && getline(f, line)) {
+    buffer.push_back(read_sentence(line, vocab));
+  }
+
+  if (buffer.size() == 0) {
+    return false;
+  }
+
+  uniform_int_distribution<unsigned> distribution(0, buffer.size() - 1);
+  unsigned i = distribution(*rndeng);
+  swap(buffer[i], buffer.back());
+  sentence.swap(buffer.back());
+  buffer.pop_back();
+  return true;
+}
+
+// Corpus cache layout. All integers are in native byte order.
+//   char[8]  magic
+//   uint32   format version
+//   uint32   vocabulary size
+//   uint64   sentence count
+//   uint64   word count
+//   vocabulary size times: uint32 length, followed by that many bytes
+//   zero padding up to a multiple of 8 bytes
+//   uint64[sentence count + 1] sentence offsets
+//   int32[word count] word ids
+static const char corpus_cache_magic[8] = {'D', 'E', 'P', 'L', 'M', 'C', 'R', 'P'};
+static const uint32_t corpus_cache_version = 1;
+
+bool IsCorpusCache(const string& filename) {
+  ifstream f(filename, ios::binary);
+  char magic[sizeof(corpus_cache_magic)];
+  if (!f.read(magic, sizeof(magic))) {
+    return false;
+  }
+  return memcmp(magic, corpus_cache_magic, sizeof(magic)) == 0;
+}
+
+void WriteCorpusCache(const string& filename, const Corpus& corpus, Dict& vocab) {
+  ofstream f(filename, ios::binary);
+  if (!f.is_open()) {
+    cerr << "Unable to open " << filename << " for writing." << endl;
+    exit(1);
+  }
+
+  const uint32_t vocab_size = vocab.size();
+  const uint64_t sentence_count = corpus.size();
+  const uint64_t word_count = corpus.word_count();
+  f.write(corpus_cache_magic, sizeof(corpus_cache_magic));
+  f.write((const char*)&corpus_cache_version, sizeof(corpus_cache_version));
+  f.write((const char*)&vocab_size, sizeof(vocab_size));
+  f.write((const char*)&sentence_count, sizeof(sentence_count));
+  f.write((const char*)&word_count, sizeof(word_count));
+
+  for (unsigned i = 0; i < vocab_size; ++i) {
+    const string& word = vocab.convert(i);
+    const uint32_t length = word.length();
+    f.write((const char*)&length, sizeof(length));
+    f.write(word.data(), length);
+  }
+
+  const char padding[8] = {};
+  f.write(padding, (8 - f.tellp() % 8) % 8);
+
+  f.write((const char*)corpus.offset_data(), sizeof(uint64_t) * (sentence_count + 1));
+  f.write((const char*)corpus.word_data(), sizeof(WordId) * word_count);
+
+  if (!f) {
+    cerr << "Error writing corpus cache to " << filename << "." << endl;
+    exit(1);
+  }
+}
+
+Corpus MapCorpusCache(const string& filename, Dict& vocab) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) {
+    cerr << "Unable to open " << filename << " for reading." << endl;
+    exit(1);
+  }
+
+  struct stat st;
+  fstat(fd, &st);
+  const size_t length = st.st_size;
+  void* base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    cerr << "Unable to map " << filename << " into memory." << endl;
+    exit(1);
+  }
+  shared_ptr<Corpus::Mapping> mapping = make_shared<Corpus::Mapping>(base, length);
+
+  const char* begin = (const char*)base;
+  const char* end = begin + length;
+  const char* p = begin;
+  auto read_header = [&](void* out, size_t size) {
+    if (p + size > end) {
+      cerr << filename << " is not a valid corpus cache: unexpected end of file." << endl;
+      exit(1);
+    }
+    memcpy(out, p, size);
+    p += size;
+  };
+
+  char magic[sizeof(corpus_cache_magic)];
+  uint32_t version;
+  uint32_t vocab_size;
+  uint64_t sentence_count;
+  uint64_t word_count;
+  read_header(magic, sizeof(magic));
+  read_header(&version, sizeof(version));
+  read_header(&vocab_size, sizeof(vocab_size));
+  read_header(&sentence_count, sizeof(sentence_count));
+  read_header(&word_count, sizeof(word_count));
+  if (memcmp(magic, corpus_cache_magic, sizeof(magic)) != 0 || version != corpus_cache_version) {
+    cerr << filename << " is not a valid corpus cache." << endl;
+    exit(1);
+  }
+
+  // Either adopt the cache's vocabulary, or make sure it matches ours
+  const bool fill_vocab = (vocab.size() == 0 && !vocab.is_frozen());
+  if (!fill_vocab && vocab.size() != vocab_size) {
+    cerr << "The vocabulary of " << filename << " does not match the model's vocabulary (" << vocab_size << " vs. " << vocab.size() << " words)." << endl;
+    exit(1);
+  }
+  for (unsigned i = 0; i < vocab_size; ++i) {
+    uint32_t word_length;
+    read_header(&word_length, sizeof(word_length));
+    if (p + word_length > end) {
+      cerr << filename << " is not a valid corpus cache: unexpected end of file." << endl;
+      exit(1);
+    }
+    const string word(p, word_length);
+    p += word_length;
+
+    if (fill_vocab) {
+      if (vocab.convert(word) != (int)i) {
+        cerr << filename << " is not a valid corpus cache: duplicate word \"" << word << "\"." << endl;
+        exit(1);
+      }
+    }
+    else if (vocab.convert(i) != word) {
+      cerr << "The vocabulary of " << filename << " does not match the model's vocabulary (word " << i << " is \"" << word << "\" vs. \"" << vocab.convert(i) << "\")." << endl;
+      exit(1);
+    }
+  }
+  p += (8 - (p - begin) % 8) % 8;
+
+  if (p + sizeof(uint64_t) * (sentence_count + 1) + sizeof(WordId) * word_count != end) {
+    cerr << filename << " is not a valid corpus cache: wrong file size." << endl;
+    exit(1);
+  }
+  mapping->offsets = (const uint64_t*)p;
+  mapping->words = (const WordId*)(p + sizeof(uint64_t) * (sentence_count + 1));
+  mapping->sentence_count = sentence_count;
+  mapping->word_count = word_count;
+
+  Corpus corpus;
+  corpus.mapping = mapping;
+  return corpus;
+}
+
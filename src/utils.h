@@ -4,6 +4,8 @@
 #include <string>
 #include <tuple>
 #include <memory>
+#include <cstdint>
+#include <fstream>
 /*#include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/binary_iarchive.hpp>
@@ -28,8 +30,69 @@ struct StandardWord : public Word {
 
 typedef vector<shared_ptr<Word>> OutputSentence;
 
+// A read-only view of a sentence stored as a contiguous array of word ids
+struct SentenceView {
+  SentenceView();
+  SentenceView(const WordId* words, unsigned length);
+  explicit SentenceView(const vector<WordId>& words);
+
+  unsigned size() const { return length; }
+  WordId operator[](unsigned i) const { return words[i]; }
+  const WordId* begin() const { return words; }
+  const WordId* end() const { return words + length; }
+
+  const WordId* words;
+  unsigned length;
+};
+
+// Stores a whole text as one flat array of word ids, plus the offset at
+// which each sentence begins. Sentences are accessed as SentenceViews, so
+// iterating over a corpus never allocates.
+// A corpus is either built up in memory one sentence at a time, or is a
+// read-only view of a memory-mapped corpus cache file (see MapCorpusCache).
+class Corpus {
+public:
+  Corpus();
+
+  void AddSentence(const vector<WordId>& sentence);
+  unsigned size() const;
+  size_t word_count() const;
+  SentenceView operator[](unsigned i) const;
+  // Views of every sentence in the corpus, in order
+  vector<SentenceView> sentences() const;
+
+  const WordId* word_data() const;
+  const uint64_t* offset_data() const;
+
+private:
+  friend Corpus MapCorpusCache(const string& filename, Dict& vocab);
+  struct Mapping;
+
+  vector<WordId> words;
+  vector<uint64_t> offsets; // Sentence i covers words[offsets[i]] to words[offsets[i + 1]]
+  shared_ptr<const Mapping> mapping;
+};
+
 unsigned Sample(const vector<float>& dist);
 
+// Draws samples from a fixed discrete distribution in constant time,
+// using Walker's alias method.
+class AliasSampler {
+public:
+  AliasSampler();
+  // The weights need not sum to one
+  explicit AliasSampler(const vector<float>& weights);
+
+  unsigned Draw() const;
+  float Probability(unsigned i) const;
+  unsigned size() const;
+
+private:
+  vector<float> probabilities;
+  vector<float> thresholds;
+  vector<unsigned> aliases;
+};
+
 unsigned int UTF8Len(unsigned char x);
 unsigned int UTF8StringLen(const string& x);
 
@@ -46,3 +109,42 @@ string vec2str(Expression expr);
 bool same_value(Expression e1, Expression e2);
 
 vector<OutputSentence> ReadText(const string& filename, Dict& vocab);
+// Reads a corpus from either a text file or a corpus cache file.
+// Cache files are detected automatically and memory-mapped.
+Corpus ReadCorpus(const string& filename, Dict& vocab);
+
+// A corpus cache is a binary file holding a vocabulary followed by the
+// corpus's word id and sentence offset arrays, laid out so that the file can
+// be memory-mapped and used as is.
+// If vocab is empty it is filled in from the cache's vocabulary. Otherwise
+// the two vocabularies must be identical, or the program exits with an error.
+bool IsCorpusCache(const string& filename);
+void WriteCorpusCache(const string& filename, const Corpus& corpus, Dict& vocab);
+Corpus MapCorpusCache(const string& filename, Dict& vocab);
+
+// Adds every word in a text file to vocab without keeping the text around.
+// Returns the number of sentences in the file.
+// If counts is not null, it is filled with the number of times each word occurs.
+unsigned ReadVocabulary(const string& filename, Dict& vocab, vector<unsigned>* counts = nullptr);
+// Returns the number of times each word of the vocabulary occurs in the corpus
+vector<unsigned> CountWords(const Corpus& corpus, unsigned vocab_size);
+
+// Reads sentences from a text file one at a time, passing them through a
+// shuffle buffer of bounded size. Memory use depends only on the buffer size,
+// not on the size of the file.
+class StreamingText {
+public:
+  StreamingText(const string& filename, Dict& vocab, unsigned buffer_size);
+
+  // Starts a new pass over the file
+  void Reset();
+  // Returns false once every sentence in the current pass has been returned
+  bool Next(vector<WordId>& sentence);
+
+private:
+  string filename;
+  Dict& vocab;
+  unsigned buffer_size;
+  ifstream f;
+  vector<vector<WordId>> buffer;
+};